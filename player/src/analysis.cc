@@ -3,10 +3,15 @@
 #include "options.h"
 #include "state.h"
 
+#include <cassert>
 #include <cstdio>
 #include <string>
 #include <vector>
 
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
 namespace {
 
 const struct ScoreWeights {
@@ -83,7 +88,14 @@ int EvalSquarePoints(
 }
 #endif
 
-short square_points_memo[2][2][2][2][2][2][2][2];
+// Note: int rather than short, so that EvaluateSquares() can gather 32-bit values.
+int square_points_memo[2][2][2][2][2][2][2][2];
+
+// Bounds on square_points_memo, indexed by [known][unknown][fixed], where each
+// index is a 4-bit mask of corners as in PreparedSquare. The minimum and
+// maximum are taken over all subsets of `unknown` corners being set in
+// addition to `known` corners. Calculated by InitializeSquarePointsBounds().
+std::pair<int, int> square_points_bounds[16][16][16];
 
 void InitializeSquarePointsMemo(const ScoreWeights &weights) {
   for (int a = 0; a < 2; ++a) {
@@ -129,6 +141,79 @@ void InitializeSquarePointsMemo(const ScoreWeights &weights) {
   }
 }
 
+// Square-incidence index, stored as flat arrays of squares plus offsets:
+// the squares with corner (r, c) are square_corner_list[i:j) with
+// i = square_corner_offset[r*WIDTH + c] and j = square_corner_offset[r*WIDTH + c + 1],
+// and similarly the squares touching a placement are indexed by
+// Placement::Index().
+std::vector<Square> square_corner_list;
+std::vector<int> square_corner_offset;
+std::vector<Square> square_placement_list;
+std::vector<int> square_placement_offset;
+
+void InitializeSquareIndex() {
+  square_corner_list.clear();
+  square_corner_offset.assign(1, 0);
+  for (int r = 0; r < HEIGHT; ++r) {
+    for (int c = 0; c < WIDTH; ++c) {
+      for (int size = 1; size < HEIGHT; ++size) {
+        for (int dr : {-size, 0}) {
+          for (int dc : {-size, 0}) {
+            int r1 = r + dr, c1 = c + dc, r2 = r1 + size, c2 = c1 + size;
+            if (r1 >= 0 && c1 >= 0 && r2 < HEIGHT && c2 < WIDTH) {
+              square_corner_list.push_back(Square{
+                  static_cast<coord_t>(r1), static_cast<coord_t>(c1),
+                  static_cast<coord_t>(r2), static_cast<coord_t>(c2)});
+            }
+          }
+        }
+      }
+      square_corner_offset.push_back(square_corner_list.size());
+    }
+  }
+
+  // The union for each placement is built from the lists of its cells. A
+  // square with multiple corners in the tile is only added the first time.
+  square_placement_list.clear();
+  square_placement_offset.assign(1, 0);
+  std::vector<int> last_added(HEIGHT * WIDTH * HEIGHT, -1);
+  for (int i = 0; i < PLACEMENT_INDEX_COUNT; ++i) {
+    const Placement placement = Placement::FromIndex(i);
+    if (placement.IsInBounds()) {
+      for (auto [r, c] : placement.Geometry().cells) {
+        for (const Square &square : SquaresWithCorner(r, c)) {
+          int id = (square.r1 * WIDTH + square.c1) * HEIGHT + (square.r2 - square.r1);
+          if (last_added[id] != i) {
+            last_added[id] = i;
+            square_placement_list.push_back(square);
+          }
+        }
+      }
+    }
+    square_placement_offset.push_back(square_placement_list.size());
+  }
+}
+
+void InitializeSquarePointsBounds() {
+  const int *memo = &square_points_memo[0][0][0][0][0][0][0][0];
+  for (int known = 0; known < 16; ++known) {
+    for (int unknown = 0; unknown < 16; ++unknown) {
+      for (int fixed = 0; fixed < 16; ++fixed) {
+        int lo = std::numeric_limits<int>::max();
+        int hi = std::numeric_limits<int>::min();
+        // Enumerate all subsets of unknown corners.
+        for (int subset = unknown; ; subset = (subset - 1) & unknown) {
+          int points = memo[(known | subset) << 4 | fixed];
+          lo = std::min(lo, points);
+          hi = std::max(hi, points);
+          if (subset == 0) break;
+        }
+        square_points_bounds[known][unknown][fixed] = {lo, hi};
+      }
+    }
+  }
+}
+
 static int EvalSquarePointsMemoized(
     bool a, bool b, bool c, bool d,
     bool fa, bool fb, bool fc, bool fd,
@@ -141,15 +226,29 @@ static int EvalSquarePointsMemoized(
 
 void InitializeAnalysis() {
   InitializeSquarePointsMemo(arg_score_weights);
+  InitializeSquarePointsBounds();
+  InitializeSquareIndex();
 }
 
-std::vector<Placement> GeneratePlacements(const grid_t &grid) {
+std::span<const Square> SquaresWithCorner(int r, int c) {
+  int i = r * WIDTH + c;
+  return std::span(square_corner_list).subspan(
+      square_corner_offset[i], square_corner_offset[i + 1] - square_corner_offset[i]);
+}
+
+std::span<const Square> SquaresTouching(const Placement &placement) {
+  int i = placement.Index();
+  return std::span(square_placement_list).subspan(
+      square_placement_offset[i], square_placement_offset[i + 1] - square_placement_offset[i]);
+}
+
+std::vector<Placement> GeneratePlacements(const Board &board) {
   std::vector<Placement> placements;
   for (coord_t row = 0; row < HEIGHT; ++row) {
     for (coord_t col = 0; col < WIDTH; ++col) {
       for (Orientation ori : ORIENTATIONS) {
         Placement placement = {row, col, ori};
-        if (placement.IsValid(grid)) {
+        if (placement.IsValid(board)) {
           placements.push_back(placement);
         }
       }
@@ -158,171 +257,376 @@ std::vector<Placement> GeneratePlacements(const grid_t &grid) {
   return placements;
 }
 
-grid_t CalcFixed(const grid_t &grid) {
-  grid_t fixed;
-  for (int r = 0; r < HEIGHT; ++r) {
-    for (int c = 0; c < WIDTH; ++c) {
-      fixed[r][c] = 1;
+PlacementSet::PlacementSet(const Board &board) {
+  for (coord_t row = 0; row < HEIGHT; ++row) {
+    for (coord_t col = 0; col < WIDTH; ++col) {
+      for (Orientation ori : ORIENTATIONS) {
+        Placement placement = {row, col, ori};
+        if (placement.IsValid(board)) Assign(placement, true);
+      }
+    }
+  }
+}
+
+void PlacementSet::Update(const Board &board, const Placement &placement) {
+  Rect bounds = placement.GetBounds();
+  for (Orientation ori : ORIENTATIONS) {
+    // A placement is affected if its cells, or the cells directly adjacent to
+    // it, overlap with the bounds of the new tile. That means its bounds,
+    // extended by 1 in each direction, must intersect the bounds of the tile.
+    int height = IsHorizontal(ori) ? 2 : COLORS;
+    int width  = IsHorizontal(ori) ? COLORS : 2;
+    int r1 = std::max(bounds.r1 - height, 0);
+    int c1 = std::max(bounds.c1 - width, 0);
+    int r2 = std::min<int>(bounds.r2, HEIGHT - height);
+    int c2 = std::min<int>(bounds.c2, WIDTH - width);
+    for (int r = r1; r <= r2; ++r) {
+      for (int c = c1; c <= c2; ++c) {
+        Placement p = {static_cast<coord_t>(r), static_cast<coord_t>(c), ori};
+        Assign(p, p.IsValid(board));
+      }
     }
   }
+}
 
-  // TODO: speed this up?
+std::vector<Placement> PlacementSet::ToVector() const {
+  std::vector<Placement> placements;
+  placements.reserve(Size());
+  ForEach([&placements](const Placement &placement) {
+    placements.push_back(placement);
+  });
+  return placements;
+}
+
+Bitboard CalcFixed(const Bitboard &occupied) {
+  // A cell is not fixed if it is covered by some 6x2 area that contains at
+  // most 4 colored cells.
+  Bitboard unfixed = {};
+
+  // Note: this recounts all areas from scratch. Use WindowCounts instead to
+  // maintain the fixed cells incrementally.
   for (int r = 0; r <= HEIGHT - 2; ++r) {
     for (int c = 0; c <= WIDTH - COLORS; ++c) {
-      int overlap = 0;
-      for (int i = 0; i < 6; ++i) {
-        overlap += grid[r][c + i] != 0;
-        overlap += grid[r + 1][c + i] != 0;
-      }
-      if (overlap <= 4) {
-        for (int i = 0; i < 6; ++i) {
-          fixed[r][c + i] = fixed[r + 1][c + i] = 0;
-        }
+      Placement placement = Placement::Horizontal(r, c);
+      if (CountOverlap(occupied, placement) <= MAX_OVERLAP) {
+        unfixed |= placement.GetMask();
       }
     }
   }
   for (int r = 0; r <= HEIGHT - COLORS; ++r) {
     for (int c = 0; c <= WIDTH - 2; ++c) {
-      int overlap = 0;
-      for (int i = 0; i < 6; ++i) {
-        overlap += grid[r + i][c] != 0;
-        overlap += grid[r + i][c + 1] != 0;
-      }
-      if (overlap <= 4) {
-        for (int i = 0; i < 6; ++i) {
-          fixed[r + i][c] = fixed[r + i][c + 1] = 0;
-        }
+      Placement placement = Placement::Vertical(r, c);
+      if (CountOverlap(occupied, placement) <= MAX_OVERLAP) {
+        unfixed |= placement.GetMask();
       }
     }
   }
-  return fixed;
+  return ~unfixed;
 }
 
-int Evaluate1(const grid_t &fixed, int r, int c) {
-  return fixed[r][c] ? arg_score_weights.fixed1 : arg_score_weights.base1;
+int Evaluate1(const Bitboard &fixed, int r, int c) {
+  return fixed.Get(r, c) ? arg_score_weights.fixed1 : arg_score_weights.base1;
 }
 
-int EvaluateRectangle(const grid_t &grid, const grid_t &fixed, color_t color, int r1, int c1, int r2, int c2) {
+int EvaluateRectangle(const Bitboard &bits, const Bitboard &fixed, int r1, int c1, int r2, int c2) {
   //  a  b
   //  c  d
-  bool a = grid[r1][c1] == color;
-  bool b = grid[r1][c2] == color;
-  bool c = grid[r2][c1] == color;
-  bool d = grid[r2][c2] == color;
-  bool fa = fixed[r1][c1];
-  bool fb = fixed[r1][c2];
-  bool fc = fixed[r2][c1];
-  bool fd = fixed[r2][c2];
+  bool a = bits.Get(r1, c1);
+  bool b = bits.Get(r1, c2);
+  bool c = bits.Get(r2, c1);
+  bool d = bits.Get(r2, c2);
+  bool fa = fixed.Get(r1, c1);
+  bool fb = fixed.Get(r1, c2);
+  bool fc = fixed.Get(r2, c1);
+  bool fd = fixed.Get(r2, c2);
   return EvalSquarePointsMemoized(a, b, c, d, fa, fb, fc, fd, r2 - r1);
   // int res = EvalSquarePointsMemoized(a, b, c, d, fa, fb, fc, fd, r2 - r1);
   // assert(res == EvalSquarePoints(a, b, c, d, fa, fb, fc, fd, r2 - r1));
   // return res;
 }
 
-void EvaluateAllColors(const grid_t &grid, const grid_t &fixed, std::array<int, COLORS> &scores) {
-  scores = {};
-  for (int color = 1; color <= COLORS; ++color) {
-    int score = 0;
-    for (int r1 = 0; r1 < HEIGHT; ++r1) {
-      for (int c1 = 0; c1 < WIDTH; ++c1) {
-        if (grid[r1][c1] == color) {
-          score += Evaluate1(fixed, r1, c1);
-        }
-        for (int r2 = r1 + 1, c2 = c1 + 1; r2 < HEIGHT && c2 < WIDTH; ++r2, ++c2) {
-          score += EvaluateRectangle(grid, fixed, color, r1, c1, r2, c2);
-        }
+PreparedSquare PrepareSquare(const Square &square, const Bitboard &fixed) {
+  auto [r1, c1, r2, c2] = square;
+  return PreparedSquare{
+      r1, c1, static_cast<coord_t>(r2 - r1),
+      static_cast<uint8_t>(
+          fixed.Get(r1, c1) << 3 | fixed.Get(r1, c2) << 2 |
+          fixed.Get(r2, c1) << 1 | fixed.Get(r2, c2))};
+}
+
+std::pair<int, int> EvaluateSquareBounds(
+    const Bitboard &bits, const Bitboard &unknown, const PreparedSquare &square) {
+  auto corners = [&square](const Bitboard &b) {
+    const int r2 = square.r1 + square.size, c2 = square.c1 + square.size;
+    return b.Get(square.r1, square.c1) << 3 | b.Get(square.r1, c2) << 2 |
+        b.Get(r2, square.c1) << 1 | b.Get(r2, c2);
+  };
+  const int unknown_corners = corners(unknown);
+  const int known_corners = corners(bits) & ~unknown_corners;
+  auto [lo, hi] = square_points_bounds[known_corners][unknown_corners][square.fixed_corners];
+  const int multiplier = square.size + 4;  // see EvalSquarePointsMemoized()
+  return {lo * multiplier, hi * multiplier};
+}
+
+int EvaluateSquares(const Bitboard &bits, std::span<const PreparedSquare> squares) {
+  // square_points_memo flattened, so that the color bits of the corners form
+  // the high nibble of the index, and the fixed bits form the low nibble.
+  const int *memo = &square_points_memo[0][0][0][0][0][0][0][0];
+  int score = 0;
+  size_t i = 0;
+
+#ifdef __AVX2__
+  // Evaluates 8 squares at a time: one per 32-bit lane. The corner rows and
+  // the memo values are fetched with gathers.
+  static_assert(sizeof(row_bits_t) == 4);
+  const int *rows = reinterpret_cast<const int*>(bits.rows.data());
+  const __m256i byte_mask = _mm256_set1_epi32(0xff);
+  const __m256i one = _mm256_set1_epi32(1);
+  __m256i sum = _mm256_setzero_si256();
+  for (; i + 8 <= squares.size(); i += 8) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&squares[i]));
+    const __m256i r1 = _mm256_and_si256(v, byte_mask);
+    const __m256i c1 = _mm256_and_si256(_mm256_srli_epi32(v, 8), byte_mask);
+    const __m256i size = _mm256_and_si256(_mm256_srli_epi32(v, 16), byte_mask);
+    const __m256i fixed_corners = _mm256_srli_epi32(v, 24);
+    const __m256i c2 = _mm256_add_epi32(c1, size);
+    const __m256i top = _mm256_i32gather_epi32(rows, r1, 4);
+    const __m256i bottom = _mm256_i32gather_epi32(rows, _mm256_add_epi32(r1, size), 4);
+    const __m256i a = _mm256_and_si256(_mm256_srlv_epi32(top, c1), one);
+    const __m256i b = _mm256_and_si256(_mm256_srlv_epi32(top, c2), one);
+    const __m256i c = _mm256_and_si256(_mm256_srlv_epi32(bottom, c1), one);
+    const __m256i d = _mm256_and_si256(_mm256_srlv_epi32(bottom, c2), one);
+    const __m256i index = _mm256_or_si256(
+        _mm256_or_si256(_mm256_slli_epi32(a, 7), _mm256_slli_epi32(b, 6)),
+        _mm256_or_si256(
+            _mm256_or_si256(_mm256_slli_epi32(c, 5), _mm256_slli_epi32(d, 4)),
+            fixed_corners));
+    const __m256i points = _mm256_i32gather_epi32(memo, index, 4);
+    // Multiplier is size + 4; see EvalSquarePointsMemoized().
+    const __m256i multiplier = _mm256_add_epi32(size, _mm256_set1_epi32(4));
+    sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(points, multiplier));
+  }
+  alignas(32) std::array<int, 8> lanes;
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lanes.data()), sum);
+  for (int lane : lanes) score += lane;
+#elif defined(__SSE4_1__)
+  // Evaluates 4 squares at a time: one per 32-bit lane. This is for CPUs
+  // without AVX2 (like the Sandy Bridge Xeon used by the CodeCup server), so
+  // there are no gathers or variable shifts: the corner rows and memo values
+  // are loaded one lane at a time, and the corner bits are tested against
+  // 1 << c, which is computed by converting c into the exponent of a float.
+  const __m128i byte_mask = _mm_set1_epi32(0xff);
+  const __m128i exponent_bias = _mm_set1_epi32(127);
+  const auto pow2 = [&](__m128i x) {
+    return _mm_cvttps_epi32(_mm_castsi128_ps(
+        _mm_slli_epi32(_mm_add_epi32(x, exponent_bias), 23)));
+  };
+  const auto test = [](__m128i row, __m128i bit, int index_bit) {
+    return _mm_and_si128(
+        _mm_cmpeq_epi32(_mm_and_si128(row, bit), bit),
+        _mm_set1_epi32(index_bit));
+  };
+  __m128i sum = _mm_setzero_si128();
+  for (; i + 4 <= squares.size(); i += 4) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&squares[i]));
+    const __m128i c1 = _mm_and_si128(_mm_srli_epi32(v, 8), byte_mask);
+    const __m128i size = _mm_and_si128(_mm_srli_epi32(v, 16), byte_mask);
+    const __m128i fixed_corners = _mm_srli_epi32(v, 24);
+    const __m128i bit1 = pow2(c1);
+    const __m128i bit2 = pow2(_mm_add_epi32(c1, size));
+    const PreparedSquare *s = &squares[i];
+    const __m128i top = _mm_setr_epi32(
+        bits.rows[s[0].r1], bits.rows[s[1].r1],
+        bits.rows[s[2].r1], bits.rows[s[3].r1]);
+    const __m128i bottom = _mm_setr_epi32(
+        bits.rows[s[0].r1 + s[0].size], bits.rows[s[1].r1 + s[1].size],
+        bits.rows[s[2].r1 + s[2].size], bits.rows[s[3].r1 + s[3].size]);
+    const __m128i index = _mm_or_si128(
+        _mm_or_si128(test(top, bit1, 1 << 7), test(top, bit2, 1 << 6)),
+        _mm_or_si128(
+            _mm_or_si128(test(bottom, bit1, 1 << 5), test(bottom, bit2, 1 << 4)),
+            fixed_corners));
+    const __m128i points = _mm_setr_epi32(
+        memo[_mm_extract_epi32(index, 0)], memo[_mm_extract_epi32(index, 1)],
+        memo[_mm_extract_epi32(index, 2)], memo[_mm_extract_epi32(index, 3)]);
+    // Multiplier is size + 4; see EvalSquarePointsMemoized().
+    const __m128i multiplier = _mm_add_epi32(size, _mm_set1_epi32(4));
+    sum = _mm_add_epi32(sum, _mm_mullo_epi32(points, multiplier));
+  }
+  alignas(16) std::array<int, 4> lanes;
+  _mm_store_si128(reinterpret_cast<__m128i*>(lanes.data()), sum);
+  for (int lane : lanes) score += lane;
+#endif
+
+  // Scalar implementation, which also handles the remaining squares.
+  for (; i < squares.size(); ++i) {
+    const auto [r1, c1, size, fixed_corners] = squares[i];
+    const int c2 = c1 + size;
+    const row_bits_t top = bits.rows[r1];
+    const row_bits_t bottom = bits.rows[r1 + size];
+    const int index =
+        ((top >> c1) & 1) << 7 | ((top >> c2) & 1) << 6 |
+        ((bottom >> c1) & 1) << 5 | ((bottom >> c2) & 1) << 4 |
+        fixed_corners;
+    score += memo[index] * (size + 4);  // see EvalSquarePointsMemoized()
+  }
+  return score;
+}
+
+int EvaluateColor(const Bitboard &bits, const Bitboard &fixed) {
+  int score =
+      arg_score_weights.base1 * (bits & ~fixed).Count() +
+      arg_score_weights.fixed1 * (bits & fixed).Count();
+
+  // Only squares with at least two corners in `bits` are worth any points, so
+  // for each square size and top row, find the columns where at least two of
+  // the corners are set, and only evaluate those.
+  for (int size = 1; size < HEIGHT; ++size) {
+    for (int r1 = 0, r2 = size; r2 < HEIGHT; ++r1, ++r2) {
+      row_bits_t a = bits.rows[r1];
+      row_bits_t b = bits.rows[r1] >> size;
+      row_bits_t c = bits.rows[r2];
+      row_bits_t d = bits.rows[r2] >> size;
+      row_bits_t candidates = ((a & b) | (c & d) | ((a | b) & (c | d))) & (ROW_MASK >> size);
+      while (candidates) {
+        int c1 = std::countr_zero(candidates);
+        candidates &= candidates - 1;
+        score += EvaluateRectangle(bits, fixed, r1, c1, r2, c1 + size);
       }
     }
-    scores[color - 1] += score;
   }
+  return score;
 }
 
-int EvaluateTwoColors(const grid_t &grid, const grid_t &fixed, int my_color, int his_color) {
-  int res = 0;
-  for (int r = 0; r < HEIGHT; ++r) {
-    for (int c = 0; c < WIDTH; ++c) {
-      if (grid[r][c] == my_color) {
-        res += Evaluate1(fixed, r, c);
-      } else if (grid[r][c] == his_color) {
-        res -= Evaluate1(fixed, r, c);
+namespace {
+
+// Returns the total score of the squares that have at least one corner in
+// `region`. Like EvaluateColor(), but excluding single cells.
+int EvaluateSquaresTouching(const Bitboard &bits, const Bitboard &fixed, const Bitboard &region) {
+  int score = 0;
+  for (int size = 1; size < HEIGHT; ++size) {
+    for (int r1 = 0, r2 = size; r2 < HEIGHT; ++r1, ++r2) {
+      if ((region.rows[r1] | region.rows[r2]) == 0) continue;
+      row_bits_t a = bits.rows[r1];
+      row_bits_t b = bits.rows[r1] >> size;
+      row_bits_t c = bits.rows[r2];
+      row_bits_t d = bits.rows[r2] >> size;
+      row_bits_t touching =
+          region.rows[r1] | (region.rows[r1] >> size) |
+          region.rows[r2] | (region.rows[r2] >> size);
+      row_bits_t candidates =
+          ((a & b) | (c & d) | ((a | b) & (c | d))) & touching & (ROW_MASK >> size);
+      while (candidates) {
+        int c1 = std::countr_zero(candidates);
+        candidates &= candidates - 1;
+        score += EvaluateRectangle(bits, fixed, r1, c1, r2, c1 + size);
       }
     }
   }
-  for (int r1 = 0; r1 < HEIGHT; ++r1) {
-    for (int c1 = 0; c1 < WIDTH; ++c1) {
-      if (grid[r1][c1] == my_color) {
-        //  xx  x.   x.
-        //  ..  x.   .x
-        //
-        //  xx  x.   xx
-        //  x.  xx   .x
-        //
-        for (int r2 = r1 + 1, c2 = c1 + 1; r2 < HEIGHT && c2 < WIDTH; ++r2, ++c2) {
-          res += EvaluateRectangle(grid, fixed, my_color, r1, c1, r2, c2);
-        }
-        //  .x ..
-        //  x. xx
-        //
-        //  .x
-        //  xx
-        //
-        for (int r2 = r1 - 1, c2 = c1 + 1; r2 >= 0 && c2 < WIDTH; --r2, ++c2) {
-          if (grid[r2][c1] != my_color) {
-            res += EvaluateRectangle(grid, fixed, my_color, r2, c1, r1, c2);
-          }
-        }
-        //  .x
-        //  .x
-        for (int r2 = r1 - 1, c2 = c1 - 1; r2 >= 0 && c2 >=0; --r2, --c2) {
-          if (grid[r1][c2] != my_color && grid[r2][c2] != my_color) {
-            res += EvaluateRectangle(grid, fixed, my_color, r2, c2, r1, c1);
-          }
-        }
-      } else if (grid[r1][c1] == his_color) {
-        //  xx  x.   x.
-        //  ..  x.   .x
-        //
-        //  xx  x.   xx
-        //  x.  xx   .x
-        //
-        for (int r2 = r1 + 1, c2 = c1 + 1; r2 < HEIGHT && c2 < WIDTH; ++r2, ++c2) {
-          res -= EvaluateRectangle(grid, fixed, his_color, r1, c1, r2, c2);
-        }
-        //  .x  ..
-        //  x.  xx
-        //
-        //  .x
-        //  xx
-        //
-        for (int r2 = r1 - 1, c2 = c1 + 1; r2 >= 0 && c2 < WIDTH; --r2, ++c2) {
-          if (grid[r2][c1] != his_color) {
-            res -= EvaluateRectangle(grid, fixed, his_color, r2, c1, r1, c2);
-          }
-        }
-        //  .x
-        //  .x
-        for (int r2 = r1 - 1, c2 = c1 - 1; r2 >= 0 && c2 >=0; --r2, --c2) {
-          if (grid[r1][c2] != his_color && grid[r2][c2] != his_color) {
-            res -= EvaluateRectangle(grid, fixed, his_color, r2, c2, r1, c1);
-          }
+  return score;
+}
+
+}  // namespace
+
+void EvaluateAllColors(const Board &board, const Bitboard &fixed, std::array<int, COLORS> &scores) {
+  for (int i = 0; i < COLORS; ++i) {
+    const Bitboard &bits = board.colors[i];
+    scores[i] =
+        arg_score_weights.base1 * (bits & ~fixed).Count() +
+        arg_score_weights.fixed1 * (bits & fixed).Count();
+  }
+
+  // Equivalent to calling EvaluateColor() for each color, but in a single pass
+  // over the squares. The rows of all colors are transposed so that the
+  // candidate squares (with at least two corners of the same color) can be
+  // found for all colors at once, which the compiler can vectorize, and the
+  // fixed bits of the corners are extracted only once per pair of rows.
+  std::array<std::array<row_bits_t, COLORS>, HEIGHT> color_rows;
+  for (int r = 0; r < HEIGHT; ++r) {
+    for (int i = 0; i < COLORS; ++i) color_rows[r][i] = board.colors[i].rows[r];
+  }
+  for (int size = 1; size < HEIGHT; ++size) {
+    for (int r1 = 0, r2 = size; r2 < HEIGHT; ++r1, ++r2) {
+      //  a  b
+      //  c  d
+      std::array<row_bits_t, COLORS> a, b, c, d, candidates;
+      for (int i = 0; i < COLORS; ++i) {
+        a[i] = color_rows[r1][i];
+        b[i] = color_rows[r1][i] >> size;
+        c[i] = color_rows[r2][i];
+        d[i] = color_rows[r2][i] >> size;
+        candidates[i] =
+            ((a[i] & b[i]) | (c[i] & d[i]) | ((a[i] | b[i]) & (c[i] | d[i]))) &
+            (ROW_MASK >> size);
+      }
+      const row_bits_t fa = fixed.rows[r1];
+      const row_bits_t fb = fixed.rows[r1] >> size;
+      const row_bits_t fc = fixed.rows[r2];
+      const row_bits_t fd = fixed.rows[r2] >> size;
+      for (int i = 0; i < COLORS; ++i) {
+        int points = 0;
+        for (row_bits_t bits = candidates[i]; bits; bits &= bits - 1) {
+          int c1 = std::countr_zero(bits);
+          points += square_points_memo
+              [(a[i] >> c1) & 1][(b[i] >> c1) & 1][(c[i] >> c1) & 1][(d[i] >> c1) & 1]
+              [(fa >> c1) & 1][(fb >> c1) & 1][(fc >> c1) & 1][(fd >> c1) & 1];
         }
+        scores[i] += points * (size + 4);  // see EvalSquarePointsMemoized()
       }
     }
   }
-  return res;
 }
 
-void EvaluateFinalScore(const grid_t &grid, std::array<int, COLORS> &scores) {
-  scores = {};
-  for (int r1 = 0; r1 < HEIGHT; ++r1) {
-    for (int c1 = 0; c1 < WIDTH; ++c1) {
-      color_t color = grid[r1][c1];
-      if (color < 1 || color > COLORS) continue;
-      for (int r2 = r1 + 1, c2 = c1 + 1; r2 < HEIGHT && c2 < WIDTH; ++r2, ++c2) {
-        if (grid[r1][c2] == color && grid[r2][c1] == color && grid[r2][c2] == color) {
-          scores[color - 1] += r2 - r1;
-        }
+int EvaluateTwoColors(const Board &board, const Bitboard &fixed, int my_color, int his_color) {
+  return EvaluateColor(board.Color(my_color), fixed) - EvaluateColor(board.Color(his_color), fixed);
+}
+
+IncrementalEvaluator::IncrementalEvaluator(const Board &board, const Bitboard &fixed)
+    : colors(board.colors), fixed(fixed) {
+  EvaluateAllColors(board, fixed, scores);
+}
+
+void IncrementalEvaluator::Update(const Board &board, const Bitboard &new_fixed) {
+  for (int i = 0; i < COLORS; ++i) {
+    const Bitboard &old_bits = colors[i];
+    const Bitboard &new_bits = board.colors[i];
+    // Squares need to be re-evaluated if any of their corners changed color or
+    // fixed status. Note that the fixed status of a corner matters even if it
+    // doesn't have this color (see InitializeSquarePointsMemo()).
+    Bitboard changed = {};
+    for (int r = 0; r < HEIGHT; ++r) {
+      changed.rows[r] =
+          (old_bits.rows[r] ^ new_bits.rows[r]) | (fixed.rows[r] ^ new_fixed.rows[r]);
+    }
+    if (changed.Empty()) continue;
+    scores[i] +=
+        arg_score_weights.base1 * ((new_bits & ~new_fixed).Count() - (old_bits & ~fixed).Count()) +
+        arg_score_weights.fixed1 * ((new_bits & new_fixed).Count() - (old_bits & fixed).Count()) +
+        EvaluateSquaresTouching(new_bits, new_fixed, changed) -
+        EvaluateSquaresTouching(old_bits, fixed, changed);
+    colors[i] = new_bits;
+  }
+  fixed = new_fixed;
+
+#if DEBUG_CHECKS
+  std::array<int, COLORS> expected_scores;
+  EvaluateAllColors(board, fixed, expected_scores);
+  assert(scores == expected_scores);
+#endif
+}
+
+void EvaluateFinalScore(const Board &board, std::array<int, COLORS> &scores) {
+  for (int color = 1; color <= COLORS; ++color) {
+    const Bitboard &bits = board.Color(color);
+    int score = 0;
+    for (int size = 1; size < HEIGHT; ++size) {
+      for (int r1 = 0, r2 = size; r2 < HEIGHT; ++r1, ++r2) {
+        row_bits_t squares =
+            bits.rows[r1] & (bits.rows[r1] >> size) &
+            bits.rows[r2] & (bits.rows[r2] >> size);
+        score += std::popcount(squares) * size;
       }
     }
+    scores[color - 1] = score;
   }
 }
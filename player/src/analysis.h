@@ -5,6 +5,8 @@
 
 #include <array>
 #include <limits>
+#include <span>
+#include <utility>
 
 // Initializes the analysis module. Must be called before any of the other
 // functions, but after parsing options.
@@ -12,24 +14,107 @@ void InitializeAnalysis();
 
 // Generates a list of all placements that are valid in the current grid,
 // in lexicographical order (row, column, orientation).
-std::vector<Placement> GeneratePlacements(const grid_t &grid);
+std::vector<Placement> GeneratePlacements(const Board &board);
 
-// Returns a boolean grid where cells are 0 if they could still be changed by
-// a future move, or 1 if they are fixed, because no valid move overlaps.
-grid_t CalcFixed(const grid_t &grid);
+// The set of valid placements for a board, which can be updated incrementally
+// after a move is executed, instead of being regenerated from scratch.
+//
+// Placements are stored as a bitmask indexed by Placement::Index(), so
+// iteration yields them in the same lexicographical order as
+// GeneratePlacements().
+class PlacementSet {
+public:
+  // Creates an empty set.
+  PlacementSet() = default;
+
+  // Creates the set of valid placements for the given board.
+  explicit PlacementSet(const Board &board);
+
+  // Updates the set after `placement` has been executed on `board`.
+  //
+  // Only placements whose area or adjacent cells intersect with the newly
+  // placed tile are rechecked, since the validity of other placements cannot
+  // have changed.
+  void Update(const Board &board, const Placement &placement);
+
+  bool Empty() const {
+    for (uint64_t word : words) if (word) return false;
+    return true;
+  }
+
+  int Size() const {
+    int size = 0;
+    for (uint64_t word : words) size += std::popcount(word);
+    return size;
+  }
+
+  // Calls func(placement) for each placement, in lexicographical order.
+  template<class Func> void ForEach(Func &&func) const {
+    for (size_t w = 0; w < words.size(); ++w) {
+      for (uint64_t word = words[w]; word; word &= word - 1) {
+        func(Placement::FromIndex(64*w + std::countr_zero(word)));
+      }
+    }
+  }
+
+  std::vector<Placement> ToVector() const;
+
+private:
+  void Assign(const Placement &placement, bool valid) {
+    int i = placement.Index();
+    uint64_t bit = uint64_t{1} << (i % 64);
+    words[i / 64] = valid ? words[i / 64] | bit : words[i / 64] & ~bit;
+  }
+
+  std::array<uint64_t, (PLACEMENT_INDEX_COUNT + 63) / 64> words = {};
+};
+
+// Returns the set of cells that are fixed, because no valid move overlaps
+// them, given the set of occupied cells.
+Bitboard CalcFixed(const Bitboard &occupied);
+
+inline Bitboard CalcFixed(const Board &board) { return CalcFixed(board.occupied); }
+
+// Evaluates the score for a single color, given the cells of that color.
+int EvaluateColor(const Bitboard &bits, const Bitboard &fixed);
 
 // Evaluates the score for all colors.
-void EvaluateAllColors(const grid_t &grid, const grid_t &fixed, std::array<int, COLORS> &scores);
+void EvaluateAllColors(const Board &board, const Bitboard &fixed, std::array<int, COLORS> &scores);
 
 // Evaluates the score for two colors, and returns the difference of my score
 // minus his score.
-int EvaluateTwoColors(const grid_t &grid, const grid_t &fixed, int my_color, int his_color);
+int EvaluateTwoColors(const Board &board, const Bitboard &fixed, int my_color, int his_color);
+
+// Maintains the scores of all colors (as calculated by EvaluateAllColors())
+// incrementally. When a tile is placed, only squares with a corner in one of
+// the changed cells, or in a cell that became fixed, are re-evaluated, so the
+// cost is proportional to the size of the move rather than the board.
+class IncrementalEvaluator {
+public:
+  IncrementalEvaluator() = default;
+
+  IncrementalEvaluator(const Board &board, const Bitboard &fixed);
+
+  // Updates the scores to match the given board and fixed cells. Typically
+  // these differ from the previous state by a single move, but any change is
+  // handled correctly.
+  void Update(const Board &board, const Bitboard &fixed);
+
+  const std::array<int, COLORS> &Scores() const { return scores; }
+
+  int Score(int color) const { return scores[color - 1]; }
+
+private:
+  std::array<Bitboard, COLORS> colors = {};
+  Bitboard fixed = {};
+  std::array<int, COLORS> scores = {};
+};
 
 // Evaluates the points awared for squares only. This corresponds with the final
 // score of the game, but it's not very useful for an intermediate evaluation
 // function, because it does not award points for partially-formed squares, and
 // doesn't distinguish between fixed and non-fixed cells.
-void EvaluateFinalScore(const grid_t &grid, std::array<int, COLORS> &scores);
+void EvaluateFinalScore(const Board &board, std::array<int, COLORS> &scores);
 
 struct SecretColorGuesser {
   std::array<int, COLORS> diff = {};
@@ -55,8 +140,46 @@ struct SecretColorGuesser {
   }
 };
 
-int Evaluate1(const grid_t &grid, int r, int c);
+// A square with corners (r1, c1) and (r2, c2), where r2 - r1 == c2 - c1 > 0.
+struct Square {
+  coord_t r1, c1, r2, c2;
+};
+
+// Returns the squares that have cell (r, c) as one of their corners.
+std::span<const Square> SquaresWithCorner(int r, int c);
+
+// Returns the squares that have at least one corner covered by the placement,
+// each listed exactly once.
+std::span<const Square> SquaresTouching(const Placement &placement);
+
+int Evaluate1(const Bitboard &fixed, int r, int c);
+
+// Evaluates the square with corners (r1, c1) and (r2, c2) for the color whose
+// cells are given by `bits`.
+int EvaluateRectangle(const Bitboard &bits, const Bitboard &fixed, int r1, int c1, int r2, int c2);
+
+// A square prepared for repeated evaluation with EvaluateSquares(), when the
+// fixed cells are known in advance but the colors of the corners are not.
+//
+// This is packed into 4 bytes, so that the vectorized implementation can load
+// one square per 32-bit lane.
+struct PreparedSquare {
+  coord_t r1, c1, size;
+  uint8_t fixed_corners;  // fixed status of corners (r1,c1), (r1,c2), (r2,c1), (r2,c2) as bits 3..0
+};
+static_assert(sizeof(PreparedSquare) == 4);
+
+PreparedSquare PrepareSquare(const Square &square, const Bitboard &fixed);
+
+// Returns the minimum and maximum value of EvaluateRectangle() for the square,
+// over all possible colorings of the corners that are in `unknown`. The other
+// corners have the color given by `bits`.
+std::pair<int, int> EvaluateSquareBounds(
+    const Bitboard &bits, const Bitboard &unknown, const PreparedSquare &square);
 
-int EvaluateRectangle(const grid_t &grid, const grid_t &fixed, color_t color, int r1, int c1, int r2, int c2);
+// Returns the sum of EvaluateRectangle() over the given squares, for the color
+// whose cells are given by `bits`. Only the colors of the corners are looked
+// up; the rest of the memo index was computed by PrepareSquare().
+int EvaluateSquares(const Bitboard &bits, std::span<const PreparedSquare> squares);
 
 #endif // ndef ANALYSIS_H_DEFINED
@@ -38,7 +38,8 @@ int main(int argc, char *argv[]) {
   SecretColorGuesser guesser[2] = {};
   int color_guess_last_incorrect[2] = {};
   std::array<int, COLORS> last_scores = {};
-  grid_t grid = {};
+  Board board = {};
+  IncrementalEvaluator evaluator;
   for (size_t move_index = 0; move_index < plain_args.size(); ++move_index) {
     const char *arg = plain_args[move_index];
     std::optional<Move> move = ParseMove(arg);
@@ -46,15 +47,17 @@ int main(int argc, char *argv[]) {
       std::cerr << "Could not parse move: " << arg << '\n';
       return EXIT_FAILURE;
     }
-    if (!(move_index == 0 ? move->placement.IsInBounds() : move->IsValid(grid))) {
+    if (!(move_index == 0 ? move->placement.IsInBounds() : move->IsValid(board))) {
       std::cerr << "Move is not valid: " << arg << '\n';
       return EXIT_FAILURE;
     }
-    move->Execute(grid);
+    move->Execute(board);
 
-    grid_t fixed = CalcFixed(grid);
+    Bitboard fixed = CalcFixed(board);
     std::array<int, COLORS> scores = {};
-    EvaluateAllColors(grid, fixed, scores);
+    EvaluateAllColors(board, fixed, scores);
+    evaluator.Update(board, fixed);
+    assert(evaluator.Scores() == scores);
     std::cerr << scores << '\n';
     if (move_index > 0) {
       int player = (move_index - 1) % 2;
@@ -67,21 +70,21 @@ int main(int argc, char *argv[]) {
 
     for (int i = 1; i < COLORS; ++i) {
       for (int j = i + 1; j < COLORS; ++j) {
-        assert(EvaluateTwoColors(grid, fixed, i, j) == scores[i - 1] - scores[j - 1]);
+        assert(EvaluateTwoColors(board, fixed, i, j) == scores[i - 1] - scores[j - 1]);
       }
     }
   }
 
-  if (!GeneratePlacements(grid).empty()) {
+  if (!GeneratePlacements(board).empty()) {
     std::cerr << "Game is not over!\n";
   }
 
   std::cerr << '\n';
-  DebugDumpGrid(grid, std::cerr);
+  DebugDumpGrid(board.grid, std::cerr);
 
   std::cerr << "Final scores:\n\n";
   std::array<int, COLORS> scores = {};
-  EvaluateFinalScore(grid, scores);
+  EvaluateFinalScore(board, scores);
   std::cerr << scores << '\n';
 
   if (color1 > 0 || color2 > 0) {
@@ -40,19 +40,19 @@ color_t MapColor(const tile_t &first_tile, color_t color) {
 
 std::vector<BestFirstMove> CalculateBestFirstMoves(
   std::function<std::vector<Placement>(
-    int color, const grid_t &grid, const tile_t &tile,
+    int color, const Board &board, const tile_t &tile,
     const std::vector<Placement> &all_placements)> find_best_placements) {
   std::vector<BestFirstMove> res;
-  grid_t grid = {};
+  Board board = {};
   tile_t tile;
   for (size_t i = 0; i < tile.size(); ++i) tile[i] = i + 1;
-  ExecuteMove(grid, tile, initial_placement);
+  ExecuteMove(board, tile, initial_placement);
   long long total = Factorial(tile.size()) * COLORS;
   long long done = 0;
-  const std::vector<Placement> all_placements = GeneratePlacements(grid);
+  const std::vector<Placement> all_placements = GeneratePlacements(board);
   for (int color = 1; color <= COLORS; ++color) {
     do {
-      for (const Placement placement : find_best_placements(color, grid, tile, all_placements)) {
+      for (const Placement placement : find_best_placements(color, board, tile, all_placements)) {
         res.push_back({.color = color, .tile=tile, .best_placement=placement});
       }
       ++done;
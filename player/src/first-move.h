@@ -17,7 +17,7 @@ struct BestFirstMove {
 // using the given evaluation function.
 std::vector<BestFirstMove> CalculateBestFirstMoves(
   std::function<std::vector<Placement>(
-    int color, const grid_t &grid, const tile_t &tile,
+    int color, const Board &board, const tile_t &tile,
     const std::vector<Placement> &all_placements)> find_best_placements);
 
 // Prints the result from CalculateBestFirstMoves() as C++ source code.
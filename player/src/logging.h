@@ -146,4 +146,37 @@ inline void LogExtraPly(int placements, bool enabled,
   LogStream("EXTRA_PLY") << placements << ' ' << (int) enabled << ' ' << time_needed << ' ' << time_left;
 }
 
+// Logs the search depth of an iteration, whether it completed before the
+// deadline, how long it took, and the number of search nodes evaluated.
+inline void LogDepth(int depth, bool completed, log_duration_t duration, int64_t nodes) {
+  LogStream("DEPTH") << depth << ' ' << (int) completed << ' ' << duration << ' ' << nodes;
+}
+
+// Logs the predicted number of turns left (including the current one), the
+// time budget for the current turn, and the time it may take to complete the
+// search without the extra ply (see TimeManager::ShallowBudget()).
+inline void LogBudget(int turns_left, log_duration_t budget, log_duration_t shallow_budget) {
+  LogStream("BUDGET") << turns_left << ' ' << budget << ' ' << shallow_budget;
+}
+
+// Logs the number of opponent moves pondered while the opponent was thinking,
+// and whether one of them matched his actual move.
+inline void LogPonder(int replies, bool hit) {
+  LogStream("PONDER") << replies << ' ' << (int) hit;
+}
+
+// Logs the number of root placements searched beyond depth 1 (the beam, see
+// --beam-width and --beam-margin), the total number of placements, and the
+// worst depth 1 rank (starting from 1) among the best placements found. With
+// the beam disabled, the rank shows how often the chosen move would have come
+// from outside a beam of a given width.
+inline void LogBeam(int beam_size, int placements, int rank) {
+  LogStream("BEAM") << beam_size << ' ' << placements << ' ' << rank;
+}
+
+// Logs the total number of lookups and hits in the transposition table.
+inline void LogCache(int64_t lookups, int64_t hits) {
+  LogStream("CACHE") << lookups << ' ' << hits;
+}
+
 #endif  // ndef LOGGING_H_INCLUDED
@@ -4,16 +4,21 @@
 #include "options.h"
 #include "random.h"
 #include "state.h"
+#include "time-manager.h"
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
 #include <chrono>
 #include <cstdlib>
 #include <iostream>
 #include <limits>
 #include <optional>
+#include <span>
 #include <string>
 #include <string_view>
+#include <thread>
 
 #ifndef LOCAL_BUILD
 #define LOCAL_BUILD 0
@@ -38,7 +43,8 @@ DECLARE_OPTION(std::string, arg_seed, "", "seed",
 
 DECLARE_OPTION(int, arg_time_limit, LOCAL_BUILD ? 0 : 25, "time-limit",
     "Time limit in seconds (or 0 to disable time-based performance). "
-    "On each turn, the player uses a fraction of time remaining on analysis. "
+    "The time manager gives each turn a budget based on the measured search "
+    "speed and the predicted number of turns left. "
     "Note that this should be slightly lower than the official time limit to "
     "account for overhead.");
 
@@ -51,50 +57,217 @@ DECLARE_OPTION(bool, arg_first_move_table, true, "first-move-table",
 DECLARE_OPTION(int, arg_extra_ply, 0, "extra-ply",
     "Insert an extra search ply if remaining placements is strictly less than this value");
 
-// A simple timer. Can be running or paused. Tracks time both while running and
-// while paused. Use Elapsed() to query, Pause() and Resume() to switch states.
-class Timer {
+DECLARE_OPTION(int, arg_beam_width, 0, "beam-width",
+    "Only search the given number of best placements at 1 ply any deeper "
+    "(or 0 to search all placements).");
+
+DECLARE_OPTION(int, arg_beam_margin, 0, "beam-margin",
+    "Only search placements whose 1-ply score is within this margin of the "
+    "best any deeper (or 0 for no margin).");
+
+DECLARE_OPTION(int, arg_reply_width, 0, "reply-width",
+    "With --prune, first search only the given number of most damaging "
+    "opponent replies in the second ply, and only search the rest if the "
+    "result could matter (or 0 to always search all replies).");
+
+DECLARE_OPTION(int, arg_cache_size, 0, "cache-size",
+    "Size of the transposition table that caches second-ply evaluations "
+    "under --extra-ply, in megabytes per search thread (or 0 to disable "
+    "caching).");
+
+DECLARE_OPTION(bool, arg_prune, true, "prune",
+    "Skip evaluations that provably cannot change the result of the search.");
+
+DECLARE_OPTION(int, arg_threads, 1, "threads",
+    "Number of threads used to evaluate root placements in parallel.");
+
+DECLARE_OPTION(bool, arg_ponder, false, "ponder",
+    "Precompute fixed cells for likely replies while the opponent is thinking. "
+    "Only useful if the process isn't suspended during the opponent's turn.");
+
+// A fixed-size cache of search results, keyed by a Zobrist hash of the board
+// and the pair of colors that was evaluated.
+//
+// Entries are grouped in buckets that fit in a cache line. When a bucket is
+// full, entries from previous searches are replaced first, then entries that
+// took the least work to calculate (as estimated by the caller).
+class TranspositionTable {
 public:
-  Timer(bool running = true) : running(running) {}
+  // Resizes the table to the largest power of two number of buckets that fits
+  // in the given number of bytes, and clears it.
+  void Resize(size_t bytes) {
+    buckets.assign(std::bit_floor(bytes / sizeof(Bucket)), Bucket{});
+  }
 
-  bool Running() const { return running; }
-  bool Paused() const { return !running; }
+  // Marks the start of a new search, so that older entries are preferred for
+  // replacement.
+  void NewSearch() { generation = (generation + 1) & 0x7f; }
 
-  // Returns how much time passed in the given state, in total.
-  log_duration_t Elapsed(bool while_running = true) const {
-    clock_t::duration d = elapsed[while_running];
-    if (running == while_running) d += clock_t::now() - start;
-    return std::chrono::duration_cast<log_duration_t>(d);
+  bool Enabled() const { return !buckets.empty(); }
+
+  std::optional<int> Lookup(uint64_t hash, int my_color, int his_color) {
+    ++lookups;
+    const Bucket &bucket = GetBucket(hash);
+    for (const Entry &entry : bucket.entries) {
+      if (entry.Matches(hash, my_color, his_color)) {
+        ++hits;
+        return entry.value;
+      }
+    }
+    return {};
   }
 
-  log_duration_t Pause() {
-    assert(Running());
-    return TogglePause();
+  void Store(uint64_t hash, int my_color, int his_color, int value, int cost) {
+    Bucket &bucket = GetBucket(hash);
+    Entry *victim = &bucket.entries[0];
+    for (Entry &entry : bucket.entries) {
+      if (entry.Matches(hash, my_color, his_color)) {
+        victim = &entry;
+        break;
+      }
+      if (Priority(entry) < Priority(*victim)) victim = &entry;
+    }
+    *victim = Entry{
+        .hash = hash,
+        .value = value,
+        .cost = static_cast<uint16_t>(std::min(cost, 0xffff)),
+        .my_color = static_cast<uint8_t>(my_color),
+        .his_color = static_cast<uint8_t>(his_color),
+        .generation = generation,
+        .used = true};
   }
 
-  log_duration_t Resume() {
-    assert(Paused());
-    return TogglePause();
+  int64_t Lookups() const { return lookups; }
+  int64_t Hits() const { return hits; }
+
+private:
+  struct Entry {
+    uint64_t hash;
+    int32_t value;
+    uint16_t cost;
+    uint8_t my_color : 4, his_color : 4;
+    uint8_t generation : 7, used : 1;
+
+    bool Matches(uint64_t h, int my, int his) const {
+      return used && hash == h && my_color == my && his_color == his;
+    }
+  };
+
+  static_assert(sizeof(Entry) == 16);
+
+  struct alignas(64) Bucket {
+    std::array<Entry, 4> entries;
+  };
+
+  Bucket &GetBucket(uint64_t hash) {
+    assert(Enabled());
+    return buckets[hash & (buckets.size() - 1)];
   }
 
-  // Toggles running state, and returns how much time passed since last toggle.
-  log_duration_t TogglePause() {
-    auto end = clock_t::now();
-    auto delta = end - start;
-    elapsed[running] += delta;
-    start = end;
-    running = !running;
-    return std::chrono::duration_cast<log_duration_t>(delta);
+  // Lower means more likely to be replaced.
+  int Priority(const Entry &entry) const {
+    if (!entry.used) return -2;
+    if (entry.generation != generation) return -1;
+    return entry.cost;
   }
 
+  std::vector<Bucket> buckets;
+  uint8_t generation = 0;
+  int64_t lookups = 0;
+  int64_t hits = 0;
+};
+
+// Counts how often each opponent placement was the best reply to a tile, so
+// that likely best replies can be tried first (the history heuristic).
+class HistoryTable {
+public:
+  void Clear() { counts.fill(0); }
+  void Add(const Placement &placement) { ++counts[placement.Index()]; }
+  int Get(const Placement &placement) const { return counts[placement.Index()]; }
+
 private:
-  using clock_t = std::chrono::steady_clock;
+  std::array<int, PLACEMENT_INDEX_COUNT> counts = {};
+};
+
+// Data about a placement of the opponent's tile in EvaluateSecondPly2() that
+// doesn't depend on the colors of the tile.
+struct ExtraData {
+  Placement placement;
+  Bitboard fixed;
+
+  // Base score and bounds on the score over all tiles, for each hypothesis
+  // about his color (see PrepareSecondPly()).
+  std::array<int, COLORS - 1> base_score;
+  std::array<int, COLORS - 1> min_score, max_score;
+
+  // Point into SearchContext::undecided_my_color/undecided_his_color.
+  std::span<const PreparedSquare> undecided_my_color;
+  std::array<std::span<const PreparedSquare>, COLORS - 1> undecided_his_color;
+
+  // Points of my/his color for each index of that color in the tile, filled
+  // in on demand by EvaluateTile(). Bit i of the mask is set once index i
+  // has been computed. My points are shared between hypotheses.
+  mutable std::array<int, COLORS> my_points = {};
+  mutable std::array<int, COLORS> his_points = {};
+  mutable uint8_t my_points_known = 0;
+  mutable uint8_t his_points_known = 0;
+};
+
+// Search state that belongs to a single search thread (see
+// FindBestPlacements()), so that threads never access it concurrently.
+struct SearchContext {
+  SearchContext() {
+    placements.reserve(MAX_PLACEMENTS);
+    extra_ply_placements.reserve(MAX_PLACEMENTS);
+    extra_data.reserve(MAX_PLACEMENTS);
+    order.reserve(MAX_PLACEMENTS);
+    fixed.reserve(MAX_PLACEMENTS);
+  }
 
-  bool running = false;
-  clock_t::time_point start = clock_t::now();
-  clock_t::duration elapsed[2] = {clock_t::duration{0}, clock_t::duration{0}};
+  TranspositionTable second_ply_cache;
+
+  // Best replies in EvaluateSecondPly2() and EvaluateExtraPly(), respectively.
+  // Cleared at the start of each search, so that they are shared between
+  // sibling root placements.
+  HistoryTable second_ply_history;
+  HistoryTable extra_ply_history;
+
+  // Deadline of the current search. Checked by EvaluateExtraPly() before
+  // each second-ply evaluation.
+  const Deadline *deadline = nullptr;
+
+  // Set when a search using this context was abandoned because the deadline
+  // expired. Reset by the caller at the start of each iteration.
+  bool interrupted = false;
+
+  // The fixed cells after each of the opponent's placements in the next call
+  // to EvaluateSecondPly2(), in lexicographical order, if they were
+  // precomputed by the Ponderer. Otherwise empty, and PrepareSecondPly()
+  // calculates them.
+  std::span<const Bitboard> pondered_fixed;
+
+  // Number of search nodes evaluated by EvaluateSecondPly2() in the current
+  // iteration, for the time manager. A node is a single evaluation of a
+  // placement of my tile. Preparing the ExtraData of a placement takes about
+  // as long as 32 evaluations, so it counts as 32 nodes.
+  int64_t nodes = 0;
+
+  // Scratch space for EvaluateSecondPly2() and EvaluateExtraPly(), which
+  // are not reentrant. These are cleared and reused by each call, so that
+  // the search doesn't allocate memory once they have grown to their
+  // maximum size. (The placement lists never grow, since they are reserved
+  // for the maximum number of placements.)
+  std::vector<Placement> placements;
+  std::vector<Bitboard> fixed;  // pondered_fixed, in the order of `placements`
+  std::vector<Placement> extra_ply_placements;
+  std::vector<ExtraData> extra_data;
+  std::vector<const ExtraData*> order;
+  std::vector<PreparedSquare> undecided_my_color;
+  std::array<std::vector<PreparedSquare>, COLORS - 1> undecided_his_color;
 };
 
+std::vector<SearchContext> search_contexts;
+
 // For debugging: count total number of squares generated in EvaluateTwoPly2().
 //static int64_t total_square_count;
 
@@ -167,10 +340,7 @@ void GenerateRelevantTiles(int my_color, int his_color, std::array<tile_t, 6*5>
   assert(pos == 6*5);
 }
 
-int Evaluate(int my_color, const grid_t &grid) {
-  std::array<int, COLORS> scores = {};
-  grid_t fixed = CalcFixed(grid);
-  EvaluateAllColors(grid, fixed, scores);
+int Evaluate(int my_color, const std::array<int, COLORS> &scores) {
   int my_score = scores[my_color - 1];
   int max_other_score = 0;
   for (int c = 1; c <= COLORS; ++c) {
@@ -182,27 +352,21 @@ int Evaluate(int my_color, const grid_t &grid) {
 }
 
 #if 0
-int Evaluate(int my_color, int his_color, const grid_t &grid) {
+int Evaluate(int my_color, int his_color, const Board &board) {
   std::array<int, COLORS> scores = {};
-  grid_t fixed = CalcFixed(grid);
-  EvaluateAllColors(grid, fixed, scores);
+  Bitboard fixed = CalcFixed(board);
+  EvaluateAllColors(board, fixed, scores);
   // Sanity check. Delete this to make it slightly faster.
-  assert(scores[my_color - 1] - scores[his_color - 1] == EvaluateTwoColors(grid, fixed, my_color, his_color));
+  assert(scores[my_color - 1] - scores[his_color - 1] == EvaluateTwoColors(board, fixed, my_color, his_color));
   return scores[my_color - 1] - scores[his_color - 1];
 }
 
 // Slower version of EvaluateSecondPly2().
-int EvaluateSecondPly(int my_color, int his_color, const grid_t &grid) {
-  std::vector<Placement> placements = GeneratePlacements(grid);
+int EvaluateSecondPly(int my_color, int his_color, const Board &board) {
+  std::vector<Placement> placements = GeneratePlacements(board);
   if (placements.empty()) {
     // No more moves.
-    grid_t fixed;
-    for (int r = 0; r < HEIGHT; ++r) {
-      for (int c = 0; c < WIDTH; ++c) {
-        fixed[r][c] = 1;
-      }
-    }
-    return 6 * 5 * EvaluateTwoColors(grid, fixed, my_color, his_color);
+    return 6 * 5 * EvaluateTwoColors(board, Bitboard::Full(), my_color, his_color);
   }
 
   std::array<tile_t, 6*5> tiles;
@@ -212,7 +376,7 @@ int EvaluateSecondPly(int my_color, int his_color, const grid_t &grid) {
   for (tile_t tile : tiles) {
     int best_score = std::numeric_limits<int>::max();
     for (Placement placement : placements) {
-      grid_t copy = grid;
+      Board copy = board;
       ExecuteMove(copy, tile, placement);
       int score;
       if (false) {
@@ -229,29 +393,411 @@ int EvaluateSecondPly(int my_color, int his_color, const grid_t &grid) {
 }
 #endif
 
-int EvaluateEndOfGame(int my_color, int his_color, const grid_t &original_input_grid) {
+int EvaluateEndOfGame(int my_color, int his_color, const Board &original_input_board) {
   // No more moves.
-  grid_t fixed;
-  for (int r = 0; r < HEIGHT; ++r) {
-    for (int c = 0; c < WIDTH; ++c) {
-      fixed[r][c] = 1;
-    }
-  }
   if (true) {
     // Just evaluate normally and multiply by the 6 * 5 weight that would
     // apply when considering all next possible placements.
-    return 6 * 5 * EvaluateTwoColors(original_input_grid, fixed, my_color, his_color);
+    return 6 * 5 * EvaluateTwoColors(original_input_board, Bitboard::Full(), my_color, his_color);
   } else {
     // We could evaluate by final score instead, since partial squares are
     // worthless at this point. However, empirically it doesn't seem to make
     // a significant difference, which makes sense because at this point all
     // squares are fixed anyway, and the total score is dominated by squares.
     std::array<int, COLORS> scores;
-    EvaluateFinalScore(original_input_grid, scores);
+    EvaluateFinalScore(original_input_board, scores);
     return 1000000*(scores[my_color] - scores[his_color]);
   }
 }
 
+// Collects the placements of the opponent's tile in context.placements (and
+// their pondered fixed cells, if any, in context.fixed), and resets the rest of
+// the second-ply scratch space, for PrepareSecondPly(). With
+// --prune, the placement that was most often the best reply before is moved
+// to the front, so that it can be used to probe the second ply before the
+// other placements are prepared (see PrepareSecondPlyLazily()).
+void CollectSecondPlyPlacements(const PlacementSet &placement_set, SearchContext &context) {
+  std::vector<Placement> &placements = context.placements;
+  std::vector<Bitboard> &fixed = context.fixed;
+  placements.clear();
+  fixed.assign(context.pondered_fixed.begin(), context.pondered_fixed.end());
+  context.extra_data.clear();
+  context.undecided_my_color.clear();
+  for (auto &undecided : context.undecided_his_color) undecided.clear();
+
+  // The undecided squares of a placement are a subset of the squares touching
+  // it. Reserve space for all of them up front, so that the spans in
+  // ExtraData remain valid.
+  size_t max_undecided = 0;
+  placement_set.ForEach([&](const Placement &placement) {
+    placements.push_back(placement);
+    max_undecided += SquaresTouching(placement).size();
+  });
+  context.undecided_my_color.reserve(max_undecided);
+  for (auto &undecided : context.undecided_his_color) undecided.reserve(max_undecided);
+  assert(fixed.empty() || fixed.size() == placements.size());
+
+  if (arg_prune) {
+    size_t best = 0;
+    for (size_t i = 0; i < placements.size(); ++i) {
+      if (context.second_ply_history.Get(placements[i]) > context.second_ply_history.Get(placements[best])) {
+        best = i;
+      }
+    }
+    std::swap(placements[0], placements[best]);
+    if (!fixed.empty()) std::swap(fixed[0], fixed[best]);
+  }
+}
+
+// Appends to context.extra_data the data for the placements of the opponent's
+// tile with indices in [begin, end) in context.placements (see
+// CollectSecondPlyPlacements()), for each of the given hypotheses about his
+// color. The fixed cells and my half of the scores don't depend on his color,
+// so they are computed only once for all hypotheses (see
+// EvaluateSecondPly2AllColors()). Calculating the fixed cells is the most
+// expensive part. (The number of hypotheses is a template argument, so that
+// the loops over them are unrolled.)
+template<size_t hypotheses>
+void PrepareSecondPly(
+    int my_color, const std::array<int, hypotheses> &his_colors, const Board &board,
+    const WindowCounts &window_counts, size_t begin, size_t end,
+    SearchContext &context) {
+  static_assert(0 < hypotheses && hypotheses < COLORS);
+  std::vector<ExtraData> &extra_data = context.extra_data;
+  std::vector<PreparedSquare> &all_undecided_my_color = context.undecided_my_color;
+
+  // Returns whether the score of a square that partially overlaps the
+  // placeholder tile is undecided for the color with the given cells: only if
+  // it already contains one point of the color, and the other points are not
+  // fixed to something other than the color/placeholder.
+  auto is_undecided = [](
+      const Bitboard &bits, const Bitboard &bits_or_placeholder,
+      const Bitboard &fixed, const Square &square) {
+    auto [r1, c1, r2, c2] = square;
+    return
+        (bits.Get(r1, c1) ||
+         bits.Get(r1, c2) ||
+         bits.Get(r2, c1) ||
+         bits.Get(r2, c2)) &&
+        (!fixed.Get(r1, c1) || bits_or_placeholder.Get(r1, c1)) &&
+        (!fixed.Get(r1, c2) || bits_or_placeholder.Get(r1, c2)) &&
+        (!fixed.Get(r2, c1) || bits_or_placeholder.Get(r2, c1)) &&
+        (!fixed.Get(r2, c2) || bits_or_placeholder.Get(r2, c2));
+  };
+
+  for (size_t i = begin; i < end; ++i) {
+    const Placement &placement = context.placements[i];
+
+    // Cells covered by the opponent's tile act as placeholders: they are
+    // occupied, but we don't know their colors yet.
+    const Bitboard placeholder = placement.GetMask();
+    const Bitboard not_placeholder = ~placeholder;
+    const Bitboard my_bits = board.Color(my_color) & not_placeholder;
+    const Bitboard fixed = context.fixed.empty() ? window_counts.FixedAfter(placement) : context.fixed[i];
+#if DEBUG_CHECKS
+    assert(fixed == window_counts.FixedAfter(placement));
+#endif
+    const Bitboard my_or_placeholder = my_bits | placeholder;
+    std::array<Bitboard, hypotheses> his_bits;
+    std::array<Bitboard, hypotheses> his_or_placeholder;
+    for (size_t h = 0; h < hypotheses; ++h) {
+      his_bits[h] = board.Color(his_colors[h]) & not_placeholder;
+      his_or_placeholder[h] = his_bits[h] | placeholder;
+    }
+
+    // Start with the score of the whole board excluding the tile, then take
+    // out the squares with a corner in the tile, since those are undecided.
+    int my_base_score = EvaluateColor(my_bits, fixed);
+    std::array<int, hypotheses> his_base_score;
+    for (size_t h = 0; h < hypotheses; ++h) {
+      his_base_score[h] = EvaluateColor(his_bits[h], fixed);
+    }
+    const size_t my_begin = all_undecided_my_color.size();
+    std::array<size_t, hypotheses> his_begin;
+    for (size_t h = 0; h < hypotheses; ++h) {
+      his_begin[h] = context.undecided_his_color[h].size();
+    }
+    for (const Square &square : SquaresTouching(placement)) {
+      auto [r1, c1, r2, c2] = square;
+      my_base_score -= EvaluateRectangle(my_bits, fixed, r1, c1, r2, c2);
+      for (size_t h = 0; h < hypotheses; ++h) {
+        his_base_score[h] -= EvaluateRectangle(his_bits[h], fixed, r1, c1, r2, c2);
+      }
+      if (placeholder.Get(r1, c1) && placeholder.Get(r2, c2)) {
+        // Special case: square covers placeholder tile entirely.
+        // TODO: limit this to the central square of the tile only, which is the only one
+        // that can contain two digits of the same color.
+        all_undecided_my_color.push_back(PrepareSquare(square, fixed));
+        for (size_t h = 0; h < hypotheses; ++h) {
+          context.undecided_his_color[h].push_back(PrepareSquare(square, fixed));
+        }
+      } else {
+        if (is_undecided(my_bits, my_or_placeholder, fixed, square)) {
+          all_undecided_my_color.push_back(PrepareSquare(square, fixed));
+        }
+        for (size_t h = 0; h < hypotheses; ++h) {
+          if (is_undecided(his_bits[h], his_or_placeholder[h], fixed, square)) {
+            context.undecided_his_color[h].push_back(PrepareSquare(square, fixed));
+          }
+        }
+      }
+    }
+
+    ExtraData &extra = extra_data.emplace_back();
+    extra.placement = placement;
+    extra.fixed = fixed;
+    extra.undecided_my_color = std::span<const PreparedSquare>(
+        all_undecided_my_color.data() + my_begin, all_undecided_my_color.size() - my_begin);
+    //total_square_count += extra.undecided_my_color.size();
+    for (size_t h = 0; h < hypotheses; ++h) {
+      const std::vector<PreparedSquare> &all_undecided_his_color = context.undecided_his_color[h];
+      extra.undecided_his_color[h] = std::span<const PreparedSquare>(
+          all_undecided_his_color.data() + his_begin[h], all_undecided_his_color.size() - his_begin[h]);
+      //total_square_count += extra.undecided_his_color[h].size();
+      extra.base_score[h] = my_base_score - his_base_score[h];
+      extra.min_score[h] = std::numeric_limits<int>::min();
+      extra.max_score[h] = std::numeric_limits<int>::max();
+    }
+
+    if (arg_prune) {
+      // The tile cells with my color are a pair with the same index in the
+      // tile, and similarly for his color (at a different index).
+      std::array<int, COLORS> pair_points;
+      const PlacementGeometry &geometry = placement.Geometry();
+      for (int i = 0; i < COLORS; ++i) {
+        pair_points[i] =
+            Evaluate1(fixed, geometry.cells[2 * i].r, geometry.cells[2 * i].c) +
+            Evaluate1(fixed, geometry.cells[2 * i + 1].r, geometry.cells[2 * i + 1].c);
+      }
+      auto [min_pair_points, max_pair_points] = std::minmax_element(pair_points.begin(), pair_points.end());
+      int my_min_score = *min_pair_points - *max_pair_points;
+      int my_max_score = *max_pair_points - *min_pair_points;
+      for (const PreparedSquare &square : extra.undecided_my_color) {
+        auto [lo, hi] = EvaluateSquareBounds(my_bits, placeholder, square);
+        my_min_score += lo;
+        my_max_score += hi;
+      }
+      for (size_t h = 0; h < hypotheses; ++h) {
+        extra.min_score[h] = extra.base_score[h] + my_min_score;
+        extra.max_score[h] = extra.base_score[h] + my_max_score;
+        for (const PreparedSquare &square : extra.undecided_his_color[h]) {
+          auto [lo, hi] = EvaluateSquareBounds(his_bits[h], placeholder, square);
+          extra.min_score[h] -= hi;
+          extra.max_score[h] -= lo;
+        }
+      }
+    }
+  }
+  assert(extra_data.size() == end);
+  context.nodes += 32 * (end - begin);
+}
+
+// Returns the score after the opponent places the tile with the given index
+// (see GenerateRelevantTiles()) at the placement of `extra`, which was prepared by
+// PrepareSecondPly(), for the hypothesis with index h.
+//
+// The score of a tile is the base score, plus the points of the tile cells
+// with my color and of the undecided squares of my color, minus the same for
+// his color. The points of a color only depend on the index of that color in
+// the tile (the squares of a color only look at cells of that color), so
+// instead of evaluating each of the 30 tiles separately, I compute the points
+// for each of the 6 indices of both colors on demand, and add them up. The
+// caller must reset extra.his_points_known when switching hypotheses.
+int EvaluateTile(
+    int my_color, int his_color, size_t h, const Board &board,
+    const ExtraData &extra, int tile_index, SearchContext &context) {
+  auto color_points = [](const Bitboard &color_bits, const ExtraData &extra,
+      std::span<const PreparedSquare> undecided, int index) {
+    const PlacementGeometry &geometry = extra.placement.Geometry();
+    auto [r1, c1] = geometry.cells[2 * index];
+    auto [r2, c2] = geometry.cells[2 * index + 1];
+    Bitboard bits = color_bits & ~extra.placement.GetMask();
+    bits.Set(r1, c1);
+    bits.Set(r2, c2);
+    return Evaluate1(extra.fixed, r1, c1) + Evaluate1(extra.fixed, r2, c2) +
+        EvaluateSquares(bits, undecided);
+  };
+
+  ++context.nodes;
+  const int i = tile_index / 5;
+  const int j = tile_index % 5 < i ? tile_index % 5 : tile_index % 5 + 1;
+  if ((extra.my_points_known & (1 << i)) == 0) {
+    extra.my_points[i] = color_points(board.Color(my_color), extra, extra.undecided_my_color, i);
+    extra.my_points_known |= 1 << i;
+  }
+  if ((extra.his_points_known & (1 << j)) == 0) {
+    extra.his_points[j] = color_points(board.Color(his_color), extra, extra.undecided_his_color[h], j);
+    extra.his_points_known |= 1 << j;
+  }
+  int score = extra.base_score[h] + extra.my_points[i] - extra.his_points[j];
+#if DEBUG_CHECKS
+  assert(extra.min_score[h] <= score && score <= extra.max_score[h]);
+  std::array<tile_t, 6*5> tiles;
+  GenerateRelevantTiles(my_color, his_color, tiles);
+  Board copy = board;
+  ExecuteMove(copy, tiles[tile_index], extra.placement);
+  int expected_score = extra.base_score[h];
+  const PlacementGeometry &geometry = extra.placement.Geometry();
+  for (int k = 0; k < 2 * COLORS; ++k) {
+    auto [r, c] = geometry.cells[k];
+    if (tiles[tile_index][k / 2] == my_color)  expected_score += Evaluate1(extra.fixed, r, c);
+    if (tiles[tile_index][k / 2] == his_color) expected_score -= Evaluate1(extra.fixed, r, c);
+  }
+  expected_score += EvaluateSquares(copy.Color(my_color),  extra.undecided_my_color);
+  expected_score -= EvaluateSquares(copy.Color(his_color), extra.undecided_his_color[h]);
+  assert(score == expected_score);
+#endif
+  return score;
+}
+
+// Evaluates the second ply (see EvaluateSecondPly2() below) using the data
+// prepared by PrepareSecondPly(), for the hypothesis with index h.
+int SearchSecondPly(
+    int my_color, int his_color, size_t h, const Board &board,
+    SearchContext &context, int cutoff) {
+  // Order in which placements are evaluated (by increasing lower bound, if
+  // pruning), and an upper bound on the minimum over placements for any tile.
+  std::vector<const ExtraData*> &order = context.order;
+  order.clear();
+  int max_tile_score = std::numeric_limits<int>::max();
+  for (const ExtraData &extra : context.extra_data) {
+    order.push_back(&extra);
+    max_tile_score = std::min(max_tile_score, extra.max_score[h]);
+    extra.his_points_known = 0;
+  }
+  // The placement that was most often the best reply before is tried first.
+  const ExtraData *first = order[0];
+  if (arg_prune) {
+    std::sort(order.begin(), order.end(),
+        [h](const ExtraData *a, const ExtraData *b) { return a->min_score[h] < b->min_score[h]; });
+    first = order[0];
+    for (const ExtraData *extra : order) {
+      if (context.second_ply_history.Get(extra->placement) >
+          context.second_ply_history.Get(first->placement)) {
+        first = extra;
+      }
+    }
+  }
+
+  auto evaluate = [&](int tile_index, const ExtraData &extra) {
+    return EvaluateTile(my_color, his_color, h, board, extra, tile_index, context);
+  };
+
+  // With a cutoff, this is a Star2-style search of the chance node: first,
+  // probe each tile with the first placement (see above). The
+  // result is an upper bound on that tile's minimum, and so the sum of the
+  // bounds of the remaining tiles bounds the rest of the total. Evaluation
+  // stops once the total is known to be below the cutoff.
+  const bool bounded = arg_prune && cutoff != std::numeric_limits<int>::min();
+  std::array<int, 6*5> probe_scores;
+  int probe_bound = 0;
+  if (bounded) {
+    for (int i = 0; i < 6*5; ++i) {
+      probe_scores[i] = evaluate(i, *first);
+      probe_bound += std::min(probe_scores[i], max_tile_score);
+    }
+  }
+
+  // Searches all tiles, considering only the first `max_replies` placements
+  // in `order` for each tile (besides the probed placement and the killer).
+  //
+  // Consecutive tiles often have the same best reply, so with pruning, each
+  // tile starts with the best reply to the previous tile (or the first
+  // placement), followed by the rest in order of increasing lower bound.
+  auto search_tiles = [&](size_t max_replies) {
+    const std::span<const ExtraData *const> replies =
+        std::span(order).first(std::min(order.size(), max_replies));
+    int remaining_bound = probe_bound;
+    const ExtraData *last_best = first;
+    int total_score = 0;
+    for (int i = 0; i < 6*5; ++i) {
+      int best_score = std::numeric_limits<int>::max();
+      const ExtraData *best_extra = nullptr;
+      const ExtraData *probed = nullptr;
+      const ExtraData *killer = nullptr;
+      if (bounded) {
+        remaining_bound -= std::min(probe_scores[i], max_tile_score);
+        if (total_score + std::min(probe_scores[i], max_tile_score) + remaining_bound < cutoff) {
+          return total_score + std::min(probe_scores[i], max_tile_score) + remaining_bound;
+        }
+        best_score = probe_scores[i];
+        best_extra = probed = first;
+      }
+      if (arg_prune && last_best != probed) {
+        killer = last_best;
+        int score = evaluate(i, *killer);
+        if (score < best_score) {
+          best_score = score;
+          best_extra = killer;
+        }
+      }
+      for (const ExtraData *extra : replies) {
+        if (extra->min_score[h] >= best_score) break;
+        if (extra == probed || extra == killer) continue;
+        int score = evaluate(i, *extra);
+        if (score < best_score) {
+          best_score = score;
+          best_extra = extra;
+        }
+        if (bounded && total_score + best_score + remaining_bound < cutoff) {
+          return total_score + best_score + remaining_bound;
+        }
+      }
+      if (arg_prune) {
+        context.second_ply_history.Add(best_extra->placement);
+        last_best = best_extra;
+      }
+      total_score += best_score;
+    }
+    return total_score;
+  };
+
+  // With --reply-width, I first search only the most damaging replies (by
+  // lower bound) for each tile. The opponent has fewer choices, so the result
+  // is an upper bound on the exact result, and if it is below the cutoff, it
+  // can be returned as is. Otherwise, I verify it by searching all replies.
+  // Scores are memoized in ExtraData, so the verification mostly costs the
+  // evaluations that the selective search skipped.
+  if (bounded && arg_reply_width > 0 && order.size() > (size_t) arg_reply_width) {
+    int score = search_tiles(arg_reply_width);
+    if (score < cutoff) return score;
+  }
+  return search_tiles(order.size());
+}
+
+// Prepares the second ply for the given hypotheses about his color, but lazily:
+// with --prune and a cutoff, only the first placement (the most common best
+// reply so far, see CollectSecondPlyPlacements()) is prepared at first, and
+// used to probe each tile. The sum of the probes is an upper bound on the
+// result for that hypothesis, so if it is below the cutoff for any of them,
+// it is returned without preparing the other placements, which is most of
+// the work. Otherwise, the remaining placements are prepared, and nothing is
+// returned.
+template<size_t hypotheses>
+std::optional<int> PrepareSecondPlyLazily(
+    int my_color, const std::array<int, hypotheses> &his_colors, const Board &board,
+    const PlacementSet &placement_set, const WindowCounts &window_counts,
+    SearchContext &context, int cutoff) {
+  CollectSecondPlyPlacements(placement_set, context);
+  const size_t size = context.placements.size();
+  size_t prepared = 0;
+  if (arg_prune && cutoff != std::numeric_limits<int>::min()) {
+    PrepareSecondPly(my_color, his_colors, board, window_counts, 0, 1, context);
+    prepared = 1;
+    const ExtraData &probe = context.extra_data[0];
+    for (size_t h = 0; h < hypotheses; ++h) {
+      probe.his_points_known = 0;
+      int bound = 0;
+      for (int i = 0; i < 6*5; ++i) {
+        bound += EvaluateTile(my_color, his_colors[h], h, board, probe, i, context);
+      }
+      if (bound < cutoff) return bound;
+    }
+  }
+  PrepareSecondPly(my_color, his_colors, board, window_counts, prepared, size, context);
+  return {};
+}
+
 // During the second ply, the opponent gets a random tile, then choses a
 // placement. Since the tile is random, we can average the outcome over all
 // possibilities (or equivalently, since the number of possible tiles is
@@ -271,221 +817,666 @@ int EvaluateEndOfGame(int my_color, int his_color, const grid_t &original_input_
 //    place1..N  place1..N   place1..N  |
 //
 // Note that the placements are the same for all tiles, so we can calculate
-// the list of placements up front. For a given placement, we can also
-// precalculate part of the score, since only the squares that partially overlap
-// with the newly-placed square are affected by which square is drawn!
+// the list of placements up front (or rather, the caller passes them in, since
+// they can be updated incrementally from the parent's placements). For a given
+// placement, we can also precalculate part of the score, since only the squares
+// that partially overlap with the newly-placed square are affected by which
+// square is drawn!
 //
-int EvaluateSecondPly2(int my_color, int his_color, const grid_t &original_input_grid) {
-  std::vector<Placement> placements = GeneratePlacements(original_input_grid);
-  if (placements.empty()) {
-    return EvaluateEndOfGame(my_color, his_color, original_input_grid);
+// With --prune, each placement also gets bounds on its score over all tiles.
+// Placements are evaluated in order of increasing lower bound, so that once
+// the lower bound reaches the minimum found so far, the remaining placements
+// can be skipped. And if the caller only needs to know whether the result is
+// at least `cutoff`, evaluation stops as soon as the upper bound on the total
+// drops below it; in that case, the returned value is that upper bound. Often
+// the best reply found so far already shows that, so the other placements are
+// only prepared when needed (see PrepareSecondPlyLazily()).
+//
+int EvaluateSecondPly2(
+    int my_color, int his_color, const Board &board,
+    const PlacementSet &placement_set, const WindowCounts &window_counts,
+    SearchContext &context, int cutoff = std::numeric_limits<int>::min()) {
+  if (placement_set.Empty()) {
+    return EvaluateEndOfGame(my_color, his_color, board);
+  }
+  const std::array<int, 1> his_colors = {his_color};
+  if (auto bound = PrepareSecondPlyLazily(
+        my_color, his_colors, board, placement_set, window_counts, context, cutoff)) {
+    return *bound;
   }
+  return SearchSecondPly(my_color, his_color, 0, board, context, cutoff);
+}
 
-  struct Square {
-    int r1, c1, r2, c2;
-  };
+// Returns the minimum of EvaluateSecondPly2() over all possible colors of the
+// opponent, for when I don't know his color. The work that doesn't depend on
+// his color is shared between the colors. The cutoff works the same as in
+// EvaluateSecondPly2().
+int EvaluateSecondPly2AllColors(
+    int my_color, const Board &board,
+    const PlacementSet &placement_set, const WindowCounts &window_counts,
+    SearchContext &context, int cutoff = std::numeric_limits<int>::min()) {
+  int result = std::numeric_limits<int>::max();
+  if (placement_set.Empty()) {
+    for (int his_color = 1; his_color <= COLORS; ++his_color) {
+      if (his_color == my_color) continue;
+      result = std::min(result, EvaluateEndOfGame(my_color, his_color, board));
+    }
+    return result;
+  }
+  std::array<int, COLORS - 1> his_colors;
+  for (int his_color = 1, h = 0; his_color <= COLORS; ++his_color) {
+    if (his_color != my_color) his_colors[h++] = his_color;
+  }
+  if (auto bound = PrepareSecondPlyLazily(
+        my_color, his_colors, board, placement_set, window_counts, context, cutoff)) {
+    return *bound;
+  }
+  for (size_t h = 0; h < his_colors.size(); ++h) {
+    result = std::min(result, SearchSecondPly(my_color, his_colors[h], h, board, context, cutoff));
+  }
+  return result;
+}
 
-  struct ExtraData {
-    Placement placement;
-    grid_t fixed;
-    int base_score;
-    std::vector<Square> undecided_my_color;
-    std::vector<Square> undecided_his_color;
-  };
+// Same as EvaluateSecondPly2(), but looks up the result in the given cache
+// first, so that positions reached through different move orders are only
+// evaluated once.
+//
+// The result of EvaluateSecondPly2() depends only on the occupied cells and the
+// cells with my and his color, so that's what the cache key is based on. Only
+// exact results are stored, not upper bounds returned due to the cutoff.
+int EvaluateSecondPly2Cached(
+    int my_color, int his_color, const Board &board,
+    const PlacementSet &placement_set, const WindowCounts &window_counts,
+    SearchContext &context, int cutoff = std::numeric_limits<int>::min()) {
+  TranspositionTable &cache = context.second_ply_cache;
+  if (!cache.Enabled()) {
+    return EvaluateSecondPly2(my_color, his_color, board, placement_set, window_counts, context, cutoff);
+  }
+  const uint64_t hash = board.Hash(my_color, his_color);
+  if (auto value = cache.Lookup(hash, my_color, his_color)) {
+    return *value;
+  }
+  int value = EvaluateSecondPly2(my_color, his_color, board, placement_set, window_counts, context, cutoff);
+  if (value >= cutoff) {
+    cache.Store(hash, my_color, his_color, value, placement_set.Size());
+  }
+  return value;
+}
 
-  std::vector<ExtraData> extra_data;
-  extra_data.reserve(placements.size());
-
-  const color_t placeholder_color = COLORS + 1;
-  tile_t placeholder_tile;
-  std::ranges::fill(placeholder_tile, placeholder_color);
-  for (const Placement &placement : placements) {
-    grid_t copy = original_input_grid;
-    ExecuteMove(copy, placeholder_tile, placement);
-    grid_t fixed = CalcFixed(copy);
-
-    int base_score = 0;
-    std::vector<Square> undecided_my_color;
-    std::vector<Square> undecided_his_color;
-    for (int r1 = 0; r1 < HEIGHT; ++r1) {
-      for (int c1 = 0; c1 < WIDTH; ++c1) {
-        if (copy[r1][c1] == my_color)  base_score += Evaluate1(fixed, r1, c1);
-        if (copy[r1][c1] == his_color) base_score -= Evaluate1(fixed, r1, c1);
-        for (int r2, c2, size = 1; (r2 = r1 + size) < HEIGHT && (c2 = c1 + size) < WIDTH; ++size) {
-          if (copy[r1][c1] == placeholder_color ||
-              copy[r1][c2] == placeholder_color ||
-              copy[r2][c1] == placeholder_color ||
-              copy[r2][c2] == placeholder_color) {
-            // Square contains a placeholder. Leave it as undecided for now.
-            if (copy[r1][c1] == placeholder_color &&
-                copy[r2][c2] == placeholder_color) {
-              // Special case: square covers placeholder tile entirely.
-              // TODO: limit this to the central square of the tile only, which is the only one
-              // that can contain two digits of the same color.
-              undecided_my_color.push_back({r1, c1, r2, c2});
-              undecided_his_color.push_back({r1, c1, r2, c2});
-            } else {
-              // Otherwise, only need to score this square if it already contains one point
-              // of a player's color, and the other points are not fixed to something other
-              // than my color/placeholder.
-              if ((copy[r1][c1] == my_color ||
-                   copy[r1][c2] == my_color ||
-                   copy[r2][c1] == my_color ||
-                   copy[r2][c2] == my_color) &&
-                  (!fixed[r1][c1] || copy[r1][c1] == my_color || copy[r1][c1] == placeholder_color) &&
-                  (!fixed[r1][c2] || copy[r1][c2] == my_color || copy[r1][c2] == placeholder_color) &&
-                  (!fixed[r2][c1] || copy[r2][c1] == my_color || copy[r2][c1] == placeholder_color) &&
-                  (!fixed[r2][c2] || copy[r2][c2] == my_color || copy[r2][c2] == placeholder_color)) {
-                undecided_my_color.push_back({r1, c1, r2, c2});
-              }
-              if ((copy[r1][c1] == his_color ||
-                   copy[r1][c2] == his_color ||
-                   copy[r2][c1] == his_color ||
-                   copy[r2][c2] == his_color) &&
-                  (!fixed[r1][c1] || copy[r1][c1] == his_color || copy[r1][c1] == placeholder_color) &&
-                  (!fixed[r1][c2] || copy[r1][c2] == his_color || copy[r1][c2] == placeholder_color) &&
-                  (!fixed[r2][c1] || copy[r2][c1] == his_color || copy[r2][c1] == placeholder_color) &&
-                  (!fixed[r2][c2] || copy[r2][c2] == his_color || copy[r2][c2] == placeholder_color)) {
-                undecided_his_color.push_back({r1, c1, r2, c2});
-              }
-            }
-          } else {
-            // Square contains no placeholders, so we can score it in advance.
-            base_score += EvaluateRectangle(copy, fixed, my_color,  r1, c1, r2, c2);
-            base_score -= EvaluateRectangle(copy, fixed, his_color, r1, c1, r2, c2);
-          }
-        }
-      }
-    }
-    //total_square_count += undecided_my_color.size();
-    //total_square_count += undecided_his_color.size();
-    extra_data.push_back({
-      placement, fixed, base_score,
-      std::move(undecided_my_color),
-      std::move(undecided_his_color)});
+// Adds a search ply before EvaluateSecondPly2(), where the opponent draws a
+// random tile and places it, before I do the same. The board is modified
+// during evaluation, but restored before returning.
+//
+// The cutoff works the same as in EvaluateSecondPly2(): if the result is less
+// than `cutoff`, it may be an upper bound instead of the exact value. The
+// probe for each tile is the opponent's first placement in history order.
+int EvaluateExtraPly(
+    int my_color, int his_color, Board &board,
+    const PlacementSet &placement_set, const WindowCounts &window_counts,
+    SearchContext &context, int cutoff = std::numeric_limits<int>::min()) {
+  if (placement_set.Empty()) {
+    return EvaluateEndOfGame(my_color, his_color, board);
   }
-  assert(extra_data.size() == placements.size());
 
   std::array<tile_t, 6*5> tiles;
   GenerateRelevantTiles(my_color, his_color, tiles);
+  std::vector<Placement> &placements = context.extra_ply_placements;
+  placements.clear();
+  placement_set.ForEach([&](const Placement &placement) { placements.push_back(placement); });
+  if (arg_prune) {
+    // Placements that were often the best reply before are tried first, since
+    // a good first reply makes the bounds of the later replies tighter. Ties
+    // are broken by index rather than with std::stable_sort(), which would
+    // allocate a temporary buffer.
+    std::sort(placements.begin(), placements.end(),
+        [&](const Placement &a, const Placement &b) {
+          int history_a = context.extra_ply_history.Get(a);
+          int history_b = context.extra_ply_history.Get(b);
+          return history_a != history_b ? history_a > history_b : a.Index() < b.Index();
+        });
+  }
 
-  int total_score = 0;
-  for (tile_t tile : tiles) {
-    int best_score = std::numeric_limits<int>::max();
-    for (const ExtraData &extra : extra_data) {
-      grid_t copy = original_input_grid;
-      ExecuteMove(copy, tile, extra.placement);
-      int score = extra.base_score;
-      Rect tile_bounds = extra.placement.GetBounds();
-      for (int r = tile_bounds.r1; r < tile_bounds.r2; ++r) {
-        for (int c = tile_bounds.c1; c < tile_bounds.c2; ++c) {
-          if (copy[r][c] == my_color)  score += Evaluate1(extra.fixed, r, c);
-          if (copy[r][c] == his_color) score -= Evaluate1(extra.fixed, r, c);
-        }
-      }
-      for (auto [r1, c1, r2, c2] : extra.undecided_my_color) {
-        score += EvaluateRectangle(copy, extra.fixed, my_color,  r1, c1, r2, c2);
-      }
-      for (auto [r1, c1, r2, c2] : extra.undecided_his_color) {
-        score -= EvaluateRectangle(copy, extra.fixed, his_color, r1, c1, r2, c2);
-      }
-      best_score = std::min(best_score, score);
+  // Returns the score after the opponent places the tile. If the score is
+  // greater than `max_score`, the result may be a lower bound instead (which
+  // is also greater than `max_score`). If the deadline expired, the result is
+  // meaningless.
+  auto evaluate = [&](const tile_t &tile, const Placement &placement, int max_score) {
+    if (context.deadline != nullptr && context.deadline->Expired()) {
+      context.interrupted = true;
+      return 0;
     }
-    total_score += best_score;
-  }
-  return total_score;
-}
+    UndoRecord undo;
+    ExecuteMove(board, tile, placement, undo);
+    PlacementSet next_placement_set = placement_set;
+    next_placement_set.Update(board, placement);
+    WindowCounts next_window_counts = window_counts;
+    next_window_counts.Update(placement);
+    // The opponent's evaluation is the negation of mine, so my upper bound
+    // is his cutoff.
+    int his_cutoff = max_score == std::numeric_limits<int>::max() ?
+        std::numeric_limits<int>::min() : -max_score;
+    int score = -EvaluateSecondPly2Cached(
+        his_color, my_color, board, next_placement_set, next_window_counts, context, his_cutoff);
+    UndoMove(board, undo);
+    return score;
+  };
 
-int EvaluateExtraPly(int my_color, int his_color, const grid_t &original_input_grid) {
-  std::vector<Placement> placements = GeneratePlacements(original_input_grid);
-  if (placements.empty()) {
-    return EvaluateEndOfGame(my_color, his_color, original_input_grid);
+  const bool bounded = arg_prune && cutoff != std::numeric_limits<int>::min();
+  std::array<int, 6*5> probe_scores;
+  int remaining_bound = 0;
+  if (bounded) {
+    for (size_t i = 0; i < tiles.size(); ++i) {
+      probe_scores[i] = evaluate(tiles[i], placements[0], std::numeric_limits<int>::max());
+      remaining_bound += probe_scores[i];
+    }
   }
 
-  std::array<tile_t, 6*5> tiles;
-  GenerateRelevantTiles(my_color, his_color, tiles);
+  // As in EvaluateSecondPly2(), with pruning each tile starts with the best
+  // reply to the previous tile.
+  size_t last_best = 0;
   int total_score = 0;
-  for (tile_t tile : tiles) {
+  for (size_t i = 0; i < tiles.size(); ++i) {
+    const tile_t &tile = tiles[i];
     int best_score = std::numeric_limits<int>::max();
-    for (Placement placement : placements) {
-      grid_t copy = original_input_grid;
-      ExecuteMove(copy, tile, placement);
-      int score = -EvaluateSecondPly2(his_color, my_color, copy);
+    size_t best_k = 0;
+    size_t probed = placements.size();
+    size_t killer = placements.size();
+    if (bounded) {
+      remaining_bound -= probe_scores[i];
+      if (total_score + probe_scores[i] + remaining_bound < cutoff) {
+        return total_score + probe_scores[i] + remaining_bound;
+      }
+      best_score = probe_scores[i];
+      probed = 0;
+    }
+    if (arg_prune && last_best != probed) {
+      killer = last_best;
+      int score = evaluate(tile, placements[killer], best_score);
+      if (score < best_score) {
+        best_score = score;
+        best_k = killer;
+      }
+    }
+    for (size_t k = 0; k < placements.size(); ++k) {
+      if (k == probed || k == killer) continue;
+      // Scores of at least best_score don't matter, since we take the minimum.
+      int score = evaluate(tile, placements[k], arg_prune ? best_score : std::numeric_limits<int>::max());
       if (score < best_score) {
         best_score = score;
+        best_k = k;
+        if (bounded && total_score + best_score + remaining_bound < cutoff) {
+          return total_score + best_score + remaining_bound;
+        }
       }
     }
+    if (arg_prune) {
+      context.extra_ply_history.Add(placements[best_k]);
+      last_best = best_k;
+    }
     total_score += best_score;
   }
   return total_score;
 }
 
-std::pair<std::vector<Placement>, int> FindBestPlacements(
-    int my_color, int his_color, const grid_t &grid, const tile_t &tile,
-    const std::vector<Placement> &all_placements, const Timer *timer) {
-  int best_score = std::numeric_limits<int>::min();
-  bool extra_ply = false;
-  if (arg_extra_ply > 0 && (int) all_placements.size() < arg_extra_ply) {
-    size_t p = all_placements.size();
-    if (arg_time_limit == 0) {
-      // No time limit set.
-      extra_ply = true;
-      LogExtraPly(p, extra_ply);
-    } else {
-      // Estimated time needed for the extra ply as p^4 / 50 milliseconds,
-      // where p = all_placements.size().
-      auto time_needed = std::chrono::milliseconds((int64_t) p * p * p * p / 50);
-      using namespace std::chrono;
-      auto time_left = std::chrono::seconds(arg_time_limit) - timer->Elapsed();
-      extra_ply = time_needed < time_left;
-      LogExtraPly(p, extra_ply, time_needed, time_left);
-    }
+// The position that a search starts from, together with the data derived from
+// it that every search needs: the valid placements, the fixed cells, and the
+// scores of all colors.
+//
+// This persists between turns. Rather than recomputing the derived data from
+// scratch each turn, Execute() updates it incrementally for each move played,
+// like the search does for the moves it considers.
+struct RootState {
+  explicit RootState(const Board &board)
+    : board(board), placement_set(board), window_counts(board.occupied),
+      evaluator(board, window_counts.Fixed()) {}
+
+  void Execute(const Move &move) {
+    ExecuteMove(board, move.tile, move.placement);
+    placement_set.Update(board, move.placement);
+    window_counts.Update(move.placement);
+    evaluator.Update(board, window_counts.Fixed());
+  }
+
+  Board board;
+  PlacementSet placement_set;
+  WindowCounts window_counts;
+  IncrementalEvaluator evaluator;
+};
+
+// The fixed cells after each pair of placements of my tile and the opponent's
+// reply, in the position after a move of the opponent, as precomputed by the
+// Ponderer. These only depend on which cells are occupied, so they can be
+// reused whatever tiles are drawn.
+struct PonderedReply {
+  // The occupied cells after the opponent's move.
+  Bitboard occupied;
+
+  // For each placement of my tile, indexed by Placement::Index(), the range
+  // of `fixed` with the fixed cells after each of the opponent's placements,
+  // in lexicographical order.
+  std::vector<std::pair<uint32_t, uint32_t>> ranges;
+  std::vector<Bitboard> fixed;
+
+  std::span<const Bitboard> FixedAfter(const Placement &placement) const {
+    auto [begin, size] = ranges[placement.Index()];
+    return std::span(fixed).subspan(begin, size);
   }
+};
+
+// Result of SearchBestPlacements().
+struct SearchResult {
   std::vector<Placement> best_placements;
-  for (Placement placement : all_placements) {
-    grid_t copy = grid;
-    ExecuteMove(copy, tile, placement);
+  int best_score = std::numeric_limits<int>::min();
+};
+
+// Finds the best placements for the given tile with an iterative deepening
+// search: first at depth 1 (my placement only), then at depth 2 (adding the
+// opponent's reply, if --deep is enabled), then at depth 3 (adding the extra
+// ply, if there are few enough placements and there is time for it).
+//
+// Each iteration evaluates the root placements in order of decreasing score
+// in the previous iteration, which makes the cutoffs more effective. If the
+// deadline expires, the current iteration is abandoned, and the result of the
+// last completed iteration is returned. Depth 1 is cheap, and always
+// completes. Depth 2 has its own deadline (`shallow_deadline`), which may be
+// later than the deadline for the extra ply, since giving up depth 2 costs
+// more than skipping the extra ply.
+//
+// With --beam-width or --beam-margin, only the best placements at depth 1 (the
+// beam) are searched deeper. The others keep their depth 1 rank, but can't be
+// chosen after a deeper iteration completes.
+//
+// If `time_manager` is null, the extra ply is always searched if there are few
+// enough placements. Otherwise, the time manager predicts whether it can
+// complete before the deadline, and is informed of the search speed.
+//
+// If `pondered` is not null, it has the fixed cells for the second ply.
+SearchResult SearchBestPlacements(
+    int my_color, int his_color, const RootState &root, const tile_t &tile,
+    const std::vector<Placement> &all_placements, const Deadline &deadline,
+    const Deadline &shallow_deadline, TimeManager *time_manager,
+    const PonderedReply *pondered) {
+  const Board &board = root.board;
+  const PlacementSet &placement_set = root.placement_set;
+  const WindowCounts &window_counts = root.window_counts;
+  const IncrementalEvaluator &evaluator = root.evaluator;
+
+  // Best score found so far in the current iteration, shared between threads.
+  // Root placements that provably score less than this don't need to be
+  // evaluated exactly.
+  std::atomic<int> best_score_so_far = std::numeric_limits<int>::min();
+
+  // Evaluates a single root placement at the given depth. The search executes
+  // and undoes moves on the given mutable board, which must be equal to
+  // `board` initially.
+  //
+  // If the result is less than the best score so far, it may be an upper
+  // bound instead of the exact score. If the deadline expired, the result is
+  // meaningless.
+  auto evaluate_placement = [&](
+      int depth, Board &search_board, SearchContext &context, const Placement &placement) {
+    if (depth > 1 && context.deadline->Expired()) {
+      context.interrupted = true;
+      return std::numeric_limits<int>::min();
+    }
+    UndoRecord undo;
+    ExecuteMove(search_board, tile, placement, undo);
+    PlacementSet next_placement_set = placement_set;
+    next_placement_set.Update(search_board, placement);
+    WindowCounts next_window_counts = window_counts;
+    next_window_counts.Update(placement);
     int score = std::numeric_limits<int>::max();
-    if (extra_ply) {
+    if (depth == 3) {
       assert(his_color);
-      score = EvaluateExtraPly(my_color, his_color, copy);
-    } else if (arg_deep) {
+      score = EvaluateExtraPly(my_color, his_color, search_board, next_placement_set, next_window_counts, context, best_score_so_far);
+    } else if (depth == 2) {
+      if (pondered != nullptr) context.pondered_fixed = pondered->FixedAfter(placement);
       if (his_color == 0) {
-        for (int c = 1; c <= 6; ++c) {
-          if (c == my_color) continue;
-          int s = EvaluateSecondPly2(my_color, c, copy);
-          // int t = EvaluateSecondPly(my_color, c, copy);
-          // std::cerr << s << ' ' << t << '\n';
-          // assert(s == t);
-          score = std::min(score, s);
-        }
+        score = EvaluateSecondPly2AllColors(my_color, search_board, next_placement_set, next_window_counts, context, best_score_so_far);
       } else {
-        score = EvaluateSecondPly2(my_color, his_color, copy);
-        // int tmp = EvaluateSecondPly(my_color, his_color, copy);
+        score = EvaluateSecondPly2(my_color, his_color, search_board, next_placement_set, next_window_counts, context, best_score_so_far);
+        // int tmp = EvaluateSecondPly(my_color, his_color, search_board);
         // std::cerr << score << ' ' << tmp << '\n';
         // assert(score == tmp);
       }
+      context.pondered_fixed = {};
     } else {
+      IncrementalEvaluator next_evaluator = evaluator;
+      next_evaluator.Update(search_board, next_window_counts.Fixed());
       if (his_color == 0) {
-        score = Evaluate(my_color, copy);
+        score = Evaluate(my_color, next_evaluator.Scores());
       } else {
-        score = EvaluateTwoColors(copy, CalcFixed(copy), my_color, his_color);
+        score = next_evaluator.Score(my_color) - next_evaluator.Score(his_color);
       }
     }
+    UndoMove(search_board, undo);
+    for (int best = best_score_so_far; score > best; ) {
+      if (best_score_so_far.compare_exchange_weak(best, score)) break;
+    }
+    return score;
+  };
+
+  // Indices into all_placements, in the order they are evaluated.
+  std::vector<size_t> order(all_placements.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
 
-    if (score > best_score) {
-      best_placements.clear();
-      best_score = score;
+  // Root placements are evaluated independently, so they can be distributed
+  // over multiple threads. Each thread takes the next unevaluated placement,
+  // using its own board and search context. Scores are stored by index in
+  // all_placements, so the result doesn't depend on the evaluation order or
+  // the number of threads.
+  //
+  // Returns whether the iteration completed, i.e. no evaluation was abandoned
+  // because the deadline expired.
+  auto run_iteration = [&](int depth, std::vector<int> &scores) {
+    best_score_so_far = std::numeric_limits<int>::min();
+    for (SearchContext &context : search_contexts) {
+      context.deadline = depth < 3 ? &shallow_deadline : &deadline;
+      context.interrupted = false;
+      context.nodes = 0;
+      context.second_ply_history.Clear();
+      context.extra_ply_history.Clear();
+    }
+    const int thread_count = std::min<int>(search_contexts.size(), order.size());
+    if (thread_count <= 1) {
+      Board search_board = board;
+      for (size_t i : order) {
+        scores[i] = evaluate_placement(depth, search_board, search_contexts[0], all_placements[i]);
+      }
+    } else {
+      std::atomic<size_t> next_index = 0;
+      std::vector<std::thread> threads;
+      threads.reserve(thread_count);
+      for (int t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&, t]() {
+          Board search_board = board;
+          for (size_t j; (j = next_index++) < order.size(); ) {
+            size_t i = order[j];
+            scores[i] = evaluate_placement(depth, search_board, search_contexts[t], all_placements[i]);
+          }
+        });
+      }
+      for (std::thread &thread : threads) thread.join();
     }
-    if (score == best_score) {
-      best_placements.push_back(placement);
+    for (const SearchContext &context : search_contexts) {
+      if (context.interrupted) return false;
     }
+    return true;
+  };
+
+  int max_depth = arg_deep ? 2 : 1;
+  if (arg_deep && arg_extra_ply > 0 && (int) all_placements.size() < arg_extra_ply) {
+    max_depth = 3;
   }
-  return {std::move(best_placements), best_score};
+
+  SearchResult result;
+
+  // Scores of the last completed iteration.
+  std::vector<int> scores(all_placements.size());
+
+  // Rank of each placement by its score at depth 1, starting from 0.
+  std::vector<size_t> first_ply_rank(all_placements.size());
+  for (int depth = 1; depth <= max_depth; ++depth) {
+    if (depth == 3) {
+      size_t p = all_placements.size();
+      bool extra_ply = true;
+      if (time_manager == nullptr) {
+        LogExtraPly(p, extra_ply);
+      } else {
+        // The deadline prevents overruns, so the prediction only avoids
+        // starting an iteration that is unlikely to complete.
+        auto time_needed = time_manager->PredictExtraPly(order.size(), p);
+        auto time_left = deadline.TimeLeft();
+        extra_ply = time_needed < time_left;
+        LogExtraPly(p, extra_ply, time_needed, time_left);
+      }
+      if (!extra_ply) break;
+      for (SearchContext &context : search_contexts) context.second_ply_cache.NewSearch();
+    }
+
+    // Placements outside the beam are not evaluated, and can't be chosen.
+    std::vector<int> new_scores(all_placements.size(), std::numeric_limits<int>::min());
+    auto start_time = std::chrono::steady_clock::now();
+    const bool completed = run_iteration(depth, new_scores);
+    auto duration = std::chrono::duration_cast<log_duration_t>(std::chrono::steady_clock::now() - start_time);
+    int64_t nodes = 0;
+    for (const SearchContext &context : search_contexts) nodes += context.nodes;
+    LogDepth(depth, completed, duration, nodes);
+    if (time_manager != nullptr) {
+      time_manager->RecordSearch(depth, nodes, duration);
+      if (depth == 2) time_manager->RecordSecondPly(order.size(), all_placements.size(), nodes, completed);
+      if (depth == 3) time_manager->RecordExtraPly(order.size(), all_placements.size(), nodes, completed);
+    }
+    if (!completed) break;
+    scores = std::move(new_scores);
+
+    if (depth == 3 && search_contexts[0].second_ply_cache.Enabled()) {
+      int64_t lookups = 0, hits = 0;
+      for (const SearchContext &context : search_contexts) {
+        lookups += context.second_ply_cache.Lookups();
+        hits += context.second_ply_cache.Hits();
+      }
+      LogCache(lookups, hits);
+    }
+
+    // Placements that scored best are evaluated first in the next iteration.
+    std::stable_sort(order.begin(), order.end(),
+        [&](size_t i, size_t j) { return scores[i] > scores[j]; });
+
+    if (depth == 1) {
+      for (size_t r = 0; r < order.size(); ++r) first_ply_rank[order[r]] = r;
+      size_t beam_size = order.size();
+      if (arg_beam_width > 0) {
+        beam_size = std::min<size_t>(beam_size, arg_beam_width);
+      }
+      if (arg_beam_margin > 0) {
+        const int min_score = scores[order[0]] - arg_beam_margin;
+        size_t r = 1;
+        while (r < beam_size && scores[order[r]] >= min_score) ++r;
+        beam_size = r;
+      }
+      order.resize(beam_size);
+    }
+  }
+
+  size_t worst_rank = 0;
+  for (size_t i = 0; i < all_placements.size(); ++i) {
+    if (scores[i] > result.best_score) {
+      result.best_placements.clear();
+      result.best_score = scores[i];
+      worst_rank = 0;
+    }
+    if (scores[i] == result.best_score) {
+      result.best_placements.push_back(all_placements[i]);
+      worst_rank = std::max(worst_rank, first_ply_rank[i]);
+    }
+  }
+  if (max_depth > 1) LogBeam(order.size(), all_placements.size(), worst_rank + 1);
+  return result;
+}
+
+// Finds the best placements for the given tile, within the turn's time budget
+// (if there is a time manager).
+std::pair<std::vector<Placement>, int> FindBestPlacements(
+    int my_color, int his_color, const RootState &root, const tile_t &tile,
+    const std::vector<Placement> &all_placements, TimeManager *time_manager,
+    const PonderedReply *pondered = nullptr) {
+  if (time_manager == nullptr) {
+    SearchResult result = SearchBestPlacements(
+        my_color, his_color, root, tile, all_placements, Deadline(), Deadline(), nullptr, pondered);
+    return {std::move(result.best_placements), result.best_score};
+  }
+  const int placements = all_placements.size();
+  const int empty_cells = HEIGHT * WIDTH - root.board.occupied.Count();
+  const int turns_left = TimeManager::PredictTurnsLeft(empty_cells, placements);
+  const log_duration_t budget = time_manager->TurnBudget(turns_left, placements);
+  const log_duration_t shallow_budget = time_manager->ShallowBudget(turns_left, placements);
+  LogBudget(turns_left, budget, shallow_budget);
+  const Deadline deadline = time_manager->MakeDeadline(budget);
+  const Deadline shallow_deadline = time_manager->MakeDeadline(shallow_budget);
+  SearchResult result = SearchBestPlacements(
+      my_color, his_color, root, tile, all_placements, deadline, shallow_deadline, time_manager, pondered);
+  return {std::move(result.best_placements), result.best_score};
 }
 
+// Precomputes work for my next turn while the opponent is thinking (see
+// --ponder).
+//
+// Neither my next tile nor the opponent's is known, and almost everything in
+// the search depends on the colors of the tiles. The exception is the fixed
+// cells, which only depend on which cells are occupied, and which are the
+// most expensive part of preparing the second ply (see PrepareSecondPly()).
+// So after I send my move, a background thread predicts the opponent's most
+// likely placements, and for each of them, calculates the fixed cells after
+// every placement of my tile followed by every reply of the opponent (see
+// PonderedReply). If the opponent's actual move has the same occupied cells
+// as one of those, the depth 2 search uses them instead of calculating them.
+//
+// To predict his placements, I rank them for each of his tiles (one per
+// equivalence class, see GenerateRelevantTiles()) by his one-ply score, and
+// take his best placement for every tile before his second best for any
+// tile, and so on.
+class Ponderer {
+public:
+  ~Ponderer() { Stop(); }
+
+  // Starts pondering on the given position, where it is the opponent's turn.
+  void Start(int my_color, int his_color, const RootState &root) {
+    Stop();
+    replies.clear();
+    deadline.emplace();
+    thread = std::thread(&Ponderer::Run, this, my_color, his_color, root);
+  }
+
+  // Stops pondering, and waits for the background thread to exit.
+  void Stop() {
+    if (thread.joinable()) {
+      deadline->Cancel();
+      thread.join();
+    }
+  }
+
+  // Returns the precomputed data for the given board, where it is my turn, if
+  // there is any. Pondering must be stopped.
+  const PonderedReply *Lookup(const Board &board) const {
+    assert(!thread.joinable());
+    for (const PonderedReply &reply : replies) {
+      if (reply.occupied == board.occupied) return &reply;
+    }
+    return nullptr;
+  }
+
+  // Returns the number of replies pondered since the last call to Start().
+  int Replies() const { return replies.size(); }
+
+private:
+  // Upper bound on the memory used for the fixed cells of all replies.
+  static constexpr size_t MAX_BYTES = size_t{32} << 20;
+
+  void Run(int my_color, int his_color, const RootState &root) {
+    const std::vector<Placement> placements = root.placement_set.ToVector();
+    if (placements.empty()) return;
+
+    // Rank the opponent's placements for each of his tiles.
+    //
+    // The score of a color only depends on the position of that color in the
+    // tile, so instead of evaluating each placement for all 30 tiles, I
+    // evaluate it for the 6 rotations of a single tile, which put each color
+    // in each position once, and combine the scores of his color and mine.
+    Board board = root.board;
+    const WindowCounts &window_counts = root.window_counts;
+    const IncrementalEvaluator &evaluator = root.evaluator;
+    std::array<tile_t, 6*5> his_tiles;
+    GenerateRelevantTiles(his_color, my_color, his_tiles);
+    std::array<std::vector<std::pair<int, Placement>>, 6*5> scored;
+    for (const Placement &placement : placements) {
+      const Bitboard fixed = window_counts.FixedAfter(placement);
+      std::array<int, COLORS> his_points, my_points;  // by position in the tile
+      for (int k = 0; k < COLORS; ++k) {
+        if (deadline->Expired()) return;
+        tile_t tile;
+        for (int i = 0; i < COLORS; ++i) tile[i] = (i + k) % COLORS + 1;
+        UndoRecord undo;
+        ExecuteMove(board, tile, placement, undo);
+        IncrementalEvaluator next_evaluator = evaluator;
+        next_evaluator.Update(board, fixed);
+        his_points[(his_color - 1 - k + COLORS) % COLORS] = next_evaluator.Score(his_color);
+        my_points[(my_color - 1 - k + COLORS) % COLORS] = next_evaluator.Score(my_color);
+        UndoMove(board, undo);
+      }
+      for (size_t t = 0; t < his_tiles.size(); ++t) {
+        const tile_t &tile = his_tiles[t];
+        int i = std::find(tile.begin(), tile.end(), his_color) - tile.begin();
+        int j = std::find(tile.begin(), tile.end(), my_color) - tile.begin();
+        scored[t].push_back({his_points[i] - my_points[j], placement});
+      }
+    }
+    std::array<std::vector<Placement>, 6*5> ranked_placements;
+    for (size_t t = 0; t < his_tiles.size(); ++t) {
+      std::stable_sort(scored[t].begin(), scored[t].end(),
+          [](const auto &a, const auto &b) { return a.first > b.first; });
+      for (const auto &[score, placement] : scored[t]) ranked_placements[t].push_back(placement);
+    }
+
+    // Ponder the opponent's placements by rank. The colors don't matter, so
+    // any tile will do to execute moves.
+    const tile_t &tile = his_tiles[0];
+    std::vector<bool> pondered(PLACEMENT_INDEX_COUNT);
+    size_t bytes = 0;
+    for (size_t rank = 0; rank < placements.size(); ++rank) {
+      for (size_t t = 0; t < his_tiles.size(); ++t) {
+        const Placement &his_placement = ranked_placements[t][rank];
+        if (pondered[his_placement.Index()]) continue;
+        pondered[his_placement.Index()] = true;
+
+        RootState next_root = root;
+        next_root.Execute(Move{tile, his_placement});
+        const size_t size = next_root.placement_set.Size();
+        bytes += size * size * sizeof(Bitboard);
+        if (bytes > MAX_BYTES) return;
+
+        PonderedReply reply;
+        reply.occupied = next_root.board.occupied;
+        reply.ranges.resize(PLACEMENT_INDEX_COUNT);
+        reply.fixed.reserve(size * size);
+        bool expired = false;
+        next_root.placement_set.ForEach([&](const Placement &placement) {
+          if (expired || (expired = deadline->Expired())) return;
+          UndoRecord undo;
+          ExecuteMove(next_root.board, tile, placement, undo);
+          PlacementSet next_placement_set = next_root.placement_set;
+          next_placement_set.Update(next_root.board, placement);
+          WindowCounts next_window_counts = next_root.window_counts;
+          next_window_counts.Update(placement);
+          const uint32_t begin = reply.fixed.size();
+          next_placement_set.ForEach([&](const Placement &reply_placement) {
+            reply.fixed.push_back(next_window_counts.FixedAfter(reply_placement));
+          });
+          reply.ranges[placement.Index()] = {begin, reply.fixed.size() - begin};
+          UndoMove(next_root.board, undo);
+        });
+        if (expired) return;
+        replies.push_back(std::move(reply));
+      }
+    }
+  }
+
+  // Written only by the background thread while it's running.
+  std::vector<PonderedReply> replies;
+
+  // Never expires, but is cancelled to stop the background thread.
+  std::optional<Deadline> deadline;
+
+  std::thread thread;
+};
+
+// Global, so that it can be stopped at exit (see main()).
+Ponderer ponderer;
+
 void PlayGame(rng_t &rng) {
   Timer timer(false);
+  std::optional<TimeManager> time_manager;
+  if (arg_time_limit > 0) time_manager.emplace(timer, std::chrono::seconds(arg_time_limit));
 
   // First line of input contains my secret color.
   const int my_secret_color = ReadSecretColor();
@@ -493,8 +1484,10 @@ void PlayGame(rng_t &rng) {
   // Second line of input contains the first tile placed in the center.
   Move start_move = ReadMove();
   assert(start_move.placement == initial_placement);
-  grid_t grid = {};
-  start_move.Execute(grid);
+  Board start_board = {};
+  start_move.Execute(start_board);
+  RootState root(start_board);
+  const Board &board = root.board;
 
   // Third line of input contains either "Start" if I play first, or else the
   // first move played by the opponent.
@@ -505,11 +1498,10 @@ void PlayGame(rng_t &rng) {
   std::array<int, COLORS> last_scores;
   int his_secret_color = 0;
 
-  for (int turn = 0; !IsGameOver(grid); ++turn) {
+  for (int turn = 0; !root.window_counts.IsGameOver(); ++turn) {
 
     if (arg_guess) {
-      std::array<int, COLORS> scores;
-      EvaluateAllColors(grid, CalcFixed(grid), scores);
+      const std::array<int, COLORS> &scores = root.evaluator.Scores();
       if (turn > 0 && turn % 2 == my_player) {
         guesser.Update(last_scores, scores);
         his_secret_color = guesser.Color(my_secret_color);
@@ -530,17 +1522,22 @@ void PlayGame(rng_t &rng) {
         best_placements = FindBestFirstMoves(my_secret_color, start_move, tile);
         // Note: this is only expected to pass if the table was generated with
         // the exact same options:
-        //assert(best_placements == FindBestPlacements(my_secret_color, 0, grid, tile, GeneratePlacements(grid)).first);
+        //assert(best_placements == FindBestPlacements(my_secret_color, 0, board, tile, GeneratePlacements(board)).first);
       } else {
-        std::vector<Placement> all_placements = GeneratePlacements(grid);
-        auto res = FindBestPlacements(my_secret_color, his_secret_color, grid, tile, all_placements, &timer);
+        std::vector<Placement> all_placements = root.placement_set.ToVector();
+        const PonderedReply *pondered = nullptr;
+        if (arg_ponder) {
+          pondered = ponderer.Lookup(board);
+          LogPonder(ponderer.Replies(), pondered != nullptr);
+        }
+        auto res = FindBestPlacements(my_secret_color, his_secret_color, root, tile, all_placements, time_manager ? &*time_manager : nullptr, pondered);
         best_placements = res.first;
         int best_score = res.second;
         LogMoveCount(all_placements.size(), best_placements.size(), best_score);
       }
       Move move = {tile, RandomSample(best_placements, rng)};
-      assert(move.IsValid(grid));
-      move.Execute(grid);
+      assert(move.IsValid(board));
+      root.Execute(move);
 
       // Write output.
       std::string output = FormatPlacement(move.placement);
@@ -550,18 +1547,23 @@ void PlayGame(rng_t &rng) {
       auto turn_duration = timer.Pause();
       LogTime(turn_duration, timer.Elapsed(true));
       std::cout << output << std::endl;
+
+      if (arg_ponder && his_secret_color != 0) {
+        ponderer.Start(my_secret_color, his_secret_color, root);
+      }
     } else {
       // Opponent's turn.
       if (turn > 0) input = ReadInputLine();
+      ponderer.Stop();
       std::optional<Move> move = ParseMove(input);
       if (!move) {
         LogError() << "Could not parse opponent's move: " << input;
         exit(1);
-      } else if (!move->IsValid(grid)) {
+      } else if (!move->IsValid(board)) {
         LogError() << "Opponent's move is invalid: " << input;
         exit(1);
       } else {
-        move->Execute(grid);
+        root.Execute(*move);
       }
     }
   }
@@ -601,13 +1603,31 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
+  if (arg_ponder && !arg_guess) {
+    std::cerr << "--ponder requires --guess\n";
+    return EXIT_FAILURE;
+  }
+
   InitializeAnalysis();
 
+  // ReadInputLine() calls exit() at the end of the game, possibly while
+  // pondering. The background thread must stop before global data (in any
+  // source file) is destroyed, which happens after this handler runs.
+  std::atexit([]() { ponderer.Stop(); });
+
+  search_contexts.resize(std::max(arg_threads, 1));
+  if (arg_extra_ply > 0) {
+    // Only EvaluateExtraPly() uses the cache, so don't allocate it otherwise.
+    for (SearchContext &context : search_contexts) {
+      context.second_ply_cache.Resize(static_cast<size_t>(std::max(arg_cache_size, 0)) << 20);
+    }
+  }
+
   if (arg_precompute_first_moves) {
     PrintBestFirstMoves(std::cout, CalculateBestFirstMoves(
-      [](int color, const grid_t &grid, const tile_t &tile,
+      [](int color, const Board &board, const tile_t &tile,
           const std::vector<Placement> &all_placements) {
-        return FindBestPlacements(color, 0, grid, tile, all_placements, nullptr).first;
+        return FindBestPlacements(color, 0, RootState(board), tile, all_placements, nullptr).first;
       }
     ));
     return 0;
@@ -2,92 +2,138 @@
 
 namespace {
 
-int CountOverlap(const grid_t &grid, int row, int col, Orientation ori) {
-  int result = 0;
-  if (IsHorizontal(ori)) {
-    for (int i = 0; i < COLORS; ++i) {
-      if (grid[row][col + i]) ++result;
-      if (grid[row + 1][col + COLORS - 1 - i]) ++result;
-    }
-  } else {
-    for (int i = 0; i < COLORS; ++i) {
-      if (grid[row + COLORS - 1 - i][col]) ++result;
-      if (grid[row + i][col + 1]) ++result;
-    }
+// Calls func(r, c, i) for each of the 12 cells covered by the placement, where
+// the cell gets the color at index i / 2 of the tile.
+template<class Func> void ForEachTileCell(const Placement &placement, Func &&func) {
+  const PlacementGeometry &geometry = placement.Geometry();
+  for (int i = 0; i < 2 * COLORS; ++i) {
+    func(geometry.cells[i].r, geometry.cells[i].c, i);
   }
-  return result;
 }
 
 // Checks if the tile is placed adjecent to an occupied cell of the grid.
 // Note that the corners don't count; one of the edges of the tile must touch.
-bool IsAdjacent(const grid_t &grid, int r1, int c1, Orientation ori) {
-  int r2 = r1 + (IsHorizontal(ori) ? 2 : COLORS);
-  int c2 = c1 + (IsHorizontal(ori) ? COLORS : 2);
-  if (c1 > 0) {
-    for (int r = r1; r < r2; ++r) if (grid[r][c1 - 1] != 0) return true;
-  }
-  if (c2 < WIDTH) {
-    for (int r = r1; r < r2; ++r) if (grid[r][c2] != 0) return true;
+bool IsAdjacent(const Bitboard &occupied, const Placement &placement) {
+  const PlacementGeometry &geometry = placement.Geometry();
+  row_bits_t bits = 0;
+  for (int i = 0; i < geometry.ring_size; ++i) {
+    bits |= occupied.rows[geometry.ring[i].r] >> geometry.ring[i].c;
   }
-  if (r1 > 0) {
-    for (int c = c1; c < c2; ++c) if (grid[r1 - 1][c] != 0) return true;
-  }
-  if (r2 < HEIGHT) {
-    for (int c = c1; c < c2; ++c) if (grid[r2][c] != 0) return true;
-  }
-  return false;
+  return bits & 1;
 }
 
 }  // namespace
 
-bool Placement::IsValid(const grid_t &grid) const {
+uint64_t Board::Hash(color_t my_color, color_t his_color) const {
+  uint64_t hash = 0;
+  auto add = [&](const Bitboard &bits, int key) {
+    for (int r = 0; r < HEIGHT; ++r) {
+      for (row_bits_t row = bits.rows[r]; row; row &= row - 1) {
+        hash ^= ZOBRIST_KEYS[r][std::countr_zero(row)][key];
+      }
+    }
+  };
+  add(occupied, COLORS);
+  add(Color(my_color), my_color - 1);
+  add(Color(his_color), his_color - 1);
+  return hash;
+}
+
+int CountOverlap(const Bitboard &occupied, const Placement &placement) {
+  const PlacementGeometry &geometry = placement.Geometry();
+  int result = 0;
+  for (int r = geometry.bounds.r1; r < geometry.bounds.r2; ++r) {
+    result += std::popcount(occupied.rows[r] & geometry.columns);
+  }
+  return result;
+}
+
+bool Placement::IsValid(const Board &board) const {
   if (!IsInBounds()) return false;
-  int overlap = CountOverlap(grid, row, col, ori);
+  int overlap = CountOverlap(board.occupied, *this);
   if (overlap > MAX_OVERLAP) return false;
   if (overlap > 0) return true;
-  return IsAdjacent(grid, row, col, ori);
-}
-
-// The game is over if and only if there is no 6x2 rectangular area of the grid
-// (either horizontally or vertically) that contains at most 4 colored cells.
-// Not all of these rectangular areas are valid moves (since new tiles must be
-// placed adjacent to colored cells) but at least one of them must be.
-bool IsGameOver(const grid_t &grid) {
-  // TODO: speed this up?
-  for (int r = 0; r <= HEIGHT - 2; ++r) {
-    for (int c = 0; c <= WIDTH - COLORS; ++c) {
-      int overlap = 0;
-      for (int i = 0; i < 6; ++i) {
-        overlap += grid[r][c + i] != 0;
-        overlap += grid[r + 1][c + i] != 0;
+  return IsAdjacent(board.occupied, *this);
+}
+
+WindowCounts::WindowCounts(const Bitboard &occupied) : occupied(occupied) {
+  ForEachWindow(Rect{0, 0, HEIGHT, WIDTH}, [&](const Placement &window) {
+    int count = window_count[window.Index()] = CountOverlap(occupied, window);
+    if (count <= MAX_OVERLAP) {
+      ++open_windows;
+      auto [r1, c1, r2, c2] = window.GetBounds();
+      for (int r = r1; r < r2; ++r) {
+        for (int c = c1; c < c2; ++c) ++coverage[r][c];
       }
-      if (overlap <= 4) return false;
+    }
+  });
+  for (int r = 0; r < HEIGHT; ++r) {
+    for (int c = 0; c < WIDTH; ++c) {
+      if (coverage[r][c] == 0) fixed.Set(r, c);
     }
   }
-  for (int r = 0; r <= HEIGHT - COLORS; ++r) {
-    for (int c = 0; c <= WIDTH - 2; ++c) {
-      int overlap = 0;
-      for (int i = 0; i < 6; ++i) {
-        overlap += grid[r + i][c] != 0;
-        overlap += grid[r + i][c + 1] != 0;
+}
+
+void WindowCounts::Update(const Placement &placement) {
+  const Bitboard new_cells = placement.GetMask() & ~occupied;
+  occupied |= new_cells;
+  ForEachWindow(placement.GetBounds(), [&](const Placement &window) {
+    uint8_t &count = window_count[window.Index()];
+    bool was_open = count <= MAX_OVERLAP;
+    count += CountOverlap(new_cells, window);
+    if (was_open && count > MAX_OVERLAP) {
+      // Area closed. Cells that are no longer covered become fixed.
+      --open_windows;
+      auto [r1, c1, r2, c2] = window.GetBounds();
+      for (int r = r1; r < r2; ++r) {
+        for (int c = c1; c < c2; ++c) {
+          if (--coverage[r][c] == 0) fixed.Set(r, c);
+        }
       }
-      if (overlap <= 4) return false;
     }
-  }
-  return true;
+  });
 }
 
-void ExecuteMove(grid_t &grid, const tile_t &tile, const Placement &placement) {
-  auto [row, col, ori] = placement;
-  if (IsHorizontal(ori)) {
-    for (int i = 0; i < COLORS; ++i) {
-      grid[row][col + i] = grid[row + 1][col + COLORS - 1 - i] = tile[i];
+Bitboard WindowCounts::FixedAfter(const Placement &placement) const {
+  const Bitboard new_cells = placement.GetMask() & ~occupied;
+  Bitboard result = fixed;
+  std::array<std::array<uint8_t, WIDTH>, HEIGHT> lost_coverage = {};
+  ForEachWindow(placement.GetBounds(), [&](const Placement &window) {
+    int count = window_count[window.Index()];
+    if (count <= MAX_OVERLAP && count + CountOverlap(new_cells, window) > MAX_OVERLAP) {
+      auto [r1, c1, r2, c2] = window.GetBounds();
+      for (int r = r1; r < r2; ++r) {
+        for (int c = c1; c < c2; ++c) {
+          if (++lost_coverage[r][c] == coverage[r][c]) result.Set(r, c);
+        }
+      }
     }
-  } else {
-    for (int i = 0; i < COLORS; ++i) {
-      grid[row + COLORS - 1 - i][col] = grid[row + i][col + 1] = tile[i];
+  });
+  return result;
+}
+
+void ExecuteMove(Board &board, const tile_t &tile, const Placement &placement) {
+  ForEachTileCell(placement, [&](int r, int c, int i) {
+    board.Set(r, c, tile[i / 2]);
+  });
+}
+
+void ExecuteMove(Board &board, const tile_t &tile, const Placement &placement, UndoRecord &undo) {
+  undo.placement = placement;
+  ForEachTileCell(placement, [&](int r, int c, int i) {
+    undo.colors[i] = board.Get(r, c);
+    board.Set(r, c, tile[i / 2]);
+  });
+}
+
+void UndoMove(Board &board, const UndoRecord &undo) {
+  ForEachTileCell(undo.placement, [&](int r, int c, int i) {
+    if (color_t color = undo.colors[i]) {
+      board.Set(r, c, color);
+    } else {
+      board.Clear(r, c);
     }
-  }
+  });
 }
 
 std::optional<color_t> ParseColor(char ch) {
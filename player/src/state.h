@@ -27,6 +27,65 @@ static constexpr int     MAX_OVERLAP =  4;
 using grid_t = std::array<std::array<color_t, WIDTH>, HEIGHT>;
 using tile_t = std::array<color_t, COLORS>;
 
+// One row of a bitboard. Bit `c` corresponds with column `c`.
+using row_bits_t = uint32_t;
+
+static constexpr row_bits_t ROW_MASK = (row_bits_t{1} << WIDTH) - 1;
+
+static_assert(std::numeric_limits<row_bits_t>::digits >= WIDTH);
+
+// A set of grid cells, stored as one bitmask per row.
+//
+// This allows occupancy, adjacency and square-corner queries to be answered
+// with a few shifts, ANDs and popcounts, instead of scanning the grid cell by
+// cell. Bits outside of ROW_MASK are always zero.
+struct Bitboard {
+  std::array<row_bits_t, HEIGHT> rows;
+
+  bool Get(int r, int c) const { return (rows[r] >> c) & 1; }
+  void Set(int r, int c) { rows[r] |= row_bits_t{1} << c; }
+  void Reset(int r, int c) { rows[r] &= ~(row_bits_t{1} << c); }
+
+  int Count() const {
+    int count = 0;
+    for (row_bits_t bits : rows) count += std::popcount(bits);
+    return count;
+  }
+
+  bool Empty() const {
+    row_bits_t any = 0;
+    for (row_bits_t bits : rows) any |= bits;
+    return any == 0;
+  }
+
+  static Bitboard Full() {
+    Bitboard result;
+    std::ranges::fill(result.rows, ROW_MASK);
+    return result;
+  }
+
+  Bitboard operator~() const {
+    Bitboard result;
+    for (int r = 0; r < HEIGHT; ++r) result.rows[r] = ~rows[r] & ROW_MASK;
+    return result;
+  }
+
+  Bitboard &operator&=(const Bitboard &other) {
+    for (int r = 0; r < HEIGHT; ++r) rows[r] &= other.rows[r];
+    return *this;
+  }
+
+  Bitboard &operator|=(const Bitboard &other) {
+    for (int r = 0; r < HEIGHT; ++r) rows[r] |= other.rows[r];
+    return *this;
+  }
+
+  Bitboard operator&(const Bitboard &other) const { return Bitboard(*this) &= other; }
+  Bitboard operator|(const Bitboard &other) const { return Bitboard(*this) |= other; }
+
+  bool operator==(const Bitboard&) const = default;
+};
+
 enum class Orientation : uint8_t {
   HORIZONTAL,
   VERTICAL,
@@ -37,11 +96,11 @@ static constexpr Orientation ORIENTATIONS[2] = {
   Orientation::VERTICAL,
 };
 
-inline bool IsHorizontal(const Orientation &ori) {
+constexpr bool IsHorizontal(const Orientation &ori) {
   return ori == Orientation::HORIZONTAL;
 }
 
-inline bool IsVertical(const Orientation &ori) {
+constexpr bool IsVertical(const Orientation &ori) {
   return ori == Orientation::VERTICAL;
 }
 
@@ -49,12 +108,32 @@ struct Rect {
   coord_t r1, c1, r2, c2;
 };
 
+struct Cell {
+  coord_t r, c;
+};
+
+// Dense index of a placement, so that placement lists and per-placement data
+// can be stored in compact arrays. See Placement::Index().
+using placement_index_t = uint16_t;
+
+// Number of distinct placement indices. This includes indices of placements
+// that are out of bounds, which are never used, but keep the indexing simple.
+static constexpr int PLACEMENT_INDEX_COUNT = HEIGHT * WIDTH * 2;
+
+// Upper bound on the number of valid placements in any position: the number of
+// horizontal and vertical placements that are within the bounds of the grid.
+static constexpr int MAX_PLACEMENTS =
+    (HEIGHT - 2 + 1) * (WIDTH - COLORS + 1) + (HEIGHT - COLORS + 1) * (WIDTH - 2 + 1);
+
+struct Board;
+struct PlacementGeometry;
+
 struct Placement {
   coord_t row, col;
   Orientation ori;
 
   // Verifies that the placed tile fits inside the board coordinates.
-  bool IsInBounds() const {
+  constexpr bool IsInBounds() const {
     return
         static_cast<unsigned>(row) <= HEIGHT - (IsHorizontal(ori) ? 2 : 6) &&
         static_cast<unsigned>(col) <=  WIDTH - (IsHorizontal(ori) ? 6 : 2);
@@ -62,52 +141,257 @@ struct Placement {
 
   // Verifies that a tile can be placed on the grid so that it is adjacent to
   // an existing colored cell and its overlap doesn't exceed MAX_OVERLAP.
-  bool IsValid(const grid_t &grid) const;
+  bool IsValid(const Board &board) const;
 
-  static Placement Horizontal(int row, int col) {
+  static constexpr Placement Horizontal(int row, int col) {
     return Placement{
         .row = static_cast<coord_t>(row),
         .col = static_cast<coord_t>(col),
         .ori = Orientation::HORIZONTAL};
   }
 
-  static Placement Vertical(int row, int col) {
+  static constexpr Placement Vertical(int row, int col) {
     return Placement{
         .row = static_cast<coord_t>(row),
         .col = static_cast<coord_t>(col),
         .ori = Orientation::VERTICAL};
   }
 
-  Rect GetBounds() const {
-    coord_t r2 = row + (IsHorizontal(ori) ? 2 : COLORS);
-    coord_t c2 = col + (IsHorizontal(ori) ? COLORS : 2);
-    return {row, col, r2, c2};
-  };
+  // Returns the index of this placement. Indices are ordered the same way as
+  // placements: lexicographically by (row, column, orientation).
+  constexpr placement_index_t Index() const {
+    return (row * WIDTH + col) * 2 + IsVertical(ori);
+  }
+
+  static constexpr Placement FromIndex(int i) {
+    return Placement{
+        .row = static_cast<coord_t>(i / 2 / WIDTH),
+        .col = static_cast<coord_t>(i / 2 % WIDTH),
+        .ori = i % 2 ? Orientation::VERTICAL : Orientation::HORIZONTAL};
+  }
+
+  // Returns the precomputed geometry of this placement, which must be in bounds.
+  const PlacementGeometry &Geometry() const;
+
+  Rect GetBounds() const;
+
+  // Returns the set of cells covered by the tile.
+  Bitboard GetMask() const;
 
   auto operator<=>(const Placement&) const = default;
 };
 
+// Precomputed geometry of a placement. See PLACEMENT_GEOMETRY below.
+struct PlacementGeometry {
+  // The cells covered by the tile, in tile order: cells[2*i] and cells[2*i + 1]
+  // get the color at index i of the tile.
+  std::array<Cell, 2 * COLORS> cells;
+
+  // The cells outside the tile that share an edge with it (corners don't
+  // count) and lie within the grid.
+  std::array<Cell, 2 * COLORS + 4> ring;
+  uint8_t ring_size;
+
+  // The bounding rectangle of the tile, and the column bits of each of its rows.
+  Rect bounds;
+  row_bits_t columns;
+};
+
+// Geometry of all placements, indexed by Placement::Index(). Entries for
+// placements that are out of bounds are left empty.
+inline constexpr auto PLACEMENT_GEOMETRY = [] {
+  std::array<PlacementGeometry, PLACEMENT_INDEX_COUNT> table = {};
+  for (int i = 0; i < PLACEMENT_INDEX_COUNT; ++i) {
+    const Placement placement = Placement::FromIndex(i);
+    if (!placement.IsInBounds()) continue;
+    PlacementGeometry &geometry = table[i];
+    const int row = placement.row, col = placement.col;
+    const int height = IsHorizontal(placement.ori) ? 2 : COLORS;
+    const int width  = IsHorizontal(placement.ori) ? COLORS : 2;
+    for (int j = 0; j < COLORS; ++j) {
+      if (IsHorizontal(placement.ori)) {
+        geometry.cells[2 * j]     = Cell{coord_t(row),     coord_t(col + j)};
+        geometry.cells[2 * j + 1] = Cell{coord_t(row + 1), coord_t(col + COLORS - 1 - j)};
+      } else {
+        geometry.cells[2 * j]     = Cell{coord_t(row + COLORS - 1 - j), coord_t(col)};
+        geometry.cells[2 * j + 1] = Cell{coord_t(row + j),              coord_t(col + 1)};
+      }
+    }
+    int n = 0;
+    for (int c = col; c < col + width; ++c) {
+      if (row > 0) geometry.ring[n++] = Cell{coord_t(row - 1), coord_t(c)};
+      if (row + height < HEIGHT) geometry.ring[n++] = Cell{coord_t(row + height), coord_t(c)};
+    }
+    for (int r = row; r < row + height; ++r) {
+      if (col > 0) geometry.ring[n++] = Cell{coord_t(r), coord_t(col - 1)};
+      if (col + width < WIDTH) geometry.ring[n++] = Cell{coord_t(r), coord_t(col + width)};
+    }
+    geometry.ring_size = n;
+    geometry.bounds = Rect{coord_t(row), coord_t(col), coord_t(row + height), coord_t(col + width)};
+    geometry.columns = ((row_bits_t{1} << width) - 1) << col;
+  }
+  return table;
+}();
+
+inline const PlacementGeometry &Placement::Geometry() const {
+  return PLACEMENT_GEOMETRY[Index()];
+}
+
+inline Rect Placement::GetBounds() const {
+  return Geometry().bounds;
+}
+
+inline Bitboard Placement::GetMask() const {
+  const PlacementGeometry &geometry = Geometry();
+  Bitboard mask = {};
+  for (int r = geometry.bounds.r1; r < geometry.bounds.r2; ++r) {
+    mask.rows[r] = geometry.columns;
+  }
+  return mask;
+}
+
 const Placement initial_placement = Placement::Horizontal(7, 7);
 
-// Checks if the game is over.
+// Random keys for Zobrist hashing, indexed by row, column and color - 1. The
+// extra key at index COLORS is used for hashing the set of occupied cells.
+//
+// These are generated at compile time with splitmix64, so that hashes are
+// the same on every run (which makes debugging easier).
+inline constexpr auto ZOBRIST_KEYS = [] {
+  std::array<std::array<std::array<uint64_t, COLORS + 1>, WIDTH>, HEIGHT> keys = {};
+  uint64_t state = 0;
+  for (auto &row : keys) {
+    for (auto &cell : row) {
+      for (uint64_t &key : cell) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        key = z ^ (z >> 31);
+      }
+    }
+  }
+  return keys;
+}();
+
+// The game state: the grid of colors, plus bitboards for the occupied cells
+// and the cells of each color, which are all kept in sync by ExecuteMove() and
+// UndoMove().
+struct Board {
+  grid_t grid;
+  Bitboard occupied;
+  std::array<Bitboard, COLORS> colors;  // colors[i] has the cells of color i + 1
+
+  color_t Get(int r, int c) const { return grid[r][c]; }
+
+  const Bitboard &Color(color_t color) const {
+    assert(0 < color && color <= COLORS);
+    return colors[color - 1];
+  }
+
+  // Returns a Zobrist hash of the occupied cells and the cells of the two
+  // given colors only. This identifies positions that are equivalent when
+  // evaluating just those two colors, regardless of how the other colors are
+  // distributed.
+  //
+  // The hash is calculated from scratch, rather than maintained by Set() and
+  // Clear(), because it's only needed by the second-ply cache, so the search
+  // doesn't pay for it on every move.
+  uint64_t Hash(color_t my_color, color_t his_color) const;
+
+  void Set(int r, int c, color_t color) {
+    if (color_t old_color = grid[r][c]) {
+      colors[old_color - 1].Reset(r, c);
+    } else {
+      occupied.Set(r, c);
+    }
+    grid[r][c] = color;
+    colors[color - 1].Set(r, c);
+  }
+
+  void Clear(int r, int c) {
+    if (color_t old_color = grid[r][c]) {
+      colors[old_color - 1].Reset(r, c);
+      occupied.Reset(r, c);
+    }
+    grid[r][c] = 0;
+  }
+};
+
+// Returns the number of occupied cells covered by the placement.
+int CountOverlap(const Bitboard &occupied, const Placement &placement);
+
+// Places a tile on the board, overwriting the previous digits.
+void ExecuteMove(Board &board, const tile_t &tile, const Placement &placement);
+
+// Records the cells overwritten by a move, so that it can be undone later.
+struct UndoRecord {
+  Placement placement;
+  std::array<color_t, 2 * COLORS> colors;  // previous colors, in tile order
+};
+
+// Same as above, but stores the overwritten cells in `undo`, so that the move
+// can be undone with UndoMove(). This allows the search to run on a single
+// mutable board instead of copying the board for each move.
+void ExecuteMove(Board &board, const tile_t &tile, const Placement &placement, UndoRecord &undo);
+
+// Undoes a move executed with ExecuteMove(). Moves must be undone in reverse
+// order of execution.
+void UndoMove(Board &board, const UndoRecord &undo);
+
+// Tracks for each 6x2 area of the grid (horizontal or vertical) how many of its
+// cells are occupied, and for each cell how many open areas cover it, where an
+// area is open if it contains at most MAX_OVERLAP occupied cells.
 //
-// Currently this function is slow, so only suitable for calling in the outer
-// game loop. (TODO: optimize this if it matters.)
-bool IsGameOver(const grid_t &grid);
+// A cell is fixed if and only if no open area covers it, and the game is over
+// if and only if there are no open areas left. Both are kept up to date when a
+// tile is placed, by recounting only the areas that intersect the new tile,
+// which is much cheaper than calling CalcFixed() or recounting all areas.
+class WindowCounts {
+public:
+  explicit WindowCounts(const Bitboard &occupied);
+
+  // Updates the counts after `placement` has been executed.
+  void Update(const Placement &placement);
+
+  // Returns the cells that would be fixed after executing `placement`,
+  // without changing the counts.
+  Bitboard FixedAfter(const Placement &placement) const;
 
-// Places a tile on the grid, overwriting the previous digits.
-void ExecuteMove(grid_t &grid, const tile_t &tile, const Placement &placement);
+  const Bitboard &Fixed() const { return fixed; }
 
-// Returns a boolean grid where cells are 0 if they could still be changed by
-// a future move, or 1 if they are fixed, because no valid move overlaps.
-grid_t CalcFixed(const grid_t &grid);
+  bool IsGameOver() const { return open_windows == 0; }
+
+private:
+  // Calls func(window) for each area that intersects the given bounds.
+  template<class Func> static void ForEachWindow(const Rect &bounds, Func &&func) {
+    for (Orientation ori : ORIENTATIONS) {
+      int height = IsHorizontal(ori) ? 2 : COLORS;
+      int width  = IsHorizontal(ori) ? COLORS : 2;
+      int r1 = std::max(bounds.r1 - height + 1, 0);
+      int c1 = std::max(bounds.c1 - width + 1, 0);
+      int r2 = std::min(bounds.r2 - 1, HEIGHT - height);
+      int c2 = std::min(bounds.c2 - 1, WIDTH - width);
+      for (int r = r1; r <= r2; ++r) {
+        for (int c = c1; c <= c2; ++c) {
+          func(Placement{static_cast<coord_t>(r), static_cast<coord_t>(c), ori});
+        }
+      }
+    }
+  }
+
+  Bitboard occupied;
+  Bitboard fixed = {};
+  int open_windows = 0;
+  std::array<uint8_t, PLACEMENT_INDEX_COUNT> window_count = {};  // by window index
+  std::array<std::array<uint8_t, WIDTH>, HEIGHT> coverage = {};
+};
 
 struct Move {
   tile_t tile;
   Placement placement;
 
-  bool IsValid(const grid_t &grid) const { return placement.IsValid(grid); }
-  void Execute(grid_t &grid) { return ExecuteMove(grid, tile, placement); }
+  bool IsValid(const Board &board) const { return placement.IsValid(board); }
+  void Execute(Board &board) { return ExecuteMove(board, tile, placement); }
 };
 
 // I/O support
@@ -0,0 +1,110 @@
+#include "time-manager.h"
+
+#include <algorithm>
+
+namespace {
+
+// Percentage of the time limit that is kept in reserve, for overhead that is
+// not measured by the timer (like process startup and I/O) and to cover
+// errors in the predictions.
+constexpr int RESERVE_PERCENT = 5;
+
+// Search nodes per millisecond assumed before enough has been measured. This
+// is about a fifth of the rate on my laptop, so the first predictions err on
+// the side of caution.
+constexpr double DEFAULT_NODE_RATE = 1000;
+
+// Minimum search time before the measured node rate is trusted.
+constexpr log_duration_t MIN_MEASURED_DURATION = std::chrono::milliseconds(100);
+
+// Search nodes per (root, reply) pair at depth 2, assumed before anything has
+// been measured. This is on the high side of what is measured in practice.
+constexpr double DEFAULT_SECOND_PLY_NODE_FACTOR = 40;
+
+}  // namespace
+
+int TimeManager::PredictTurnsLeft(int empty_cells, int placements) {
+  // Fitted on the games in competition-results/: the number of moves left
+  // (by both players, including the current one) is about
+  // (empty_cells + placements / 16 - 45) / 10, with a standard deviation of
+  // 1.3 moves. I add one move to err on the side of caution.
+  int moves_left = (empty_cells + placements / 16 - 35) / 10;
+
+  // I make every other move, starting with the current one.
+  return std::max(1, (moves_left + 1) / 2);
+}
+
+log_duration_t TimeManager::TurnBudget(int turns_left, int placements) const {
+  assert(turns_left > 0);
+  log_duration_t time_left = time_limit * (100 - RESERVE_PERCENT) / 100 - timer.Elapsed();
+  if (time_left <= log_duration_t(0)) return log_duration_t(0);
+
+  // Later turns need time for at least a search without the extra ply.
+  log_duration_t available = time_left - PredictLaterTurns(turns_left, placements);
+  if (available <= log_duration_t(0)) return time_left / turns_left;
+
+  // Early turns rarely use their full budget, while later turns are cheap
+  // enough to benefit from the extra ply, so the time saved early is spent
+  // late. To avoid spending it all on a single turn, a turn gets at most twice
+  // its fair share.
+  return std::min(available, 2 * available / turns_left);
+}
+
+log_duration_t TimeManager::ShallowBudget(int turns_left, int placements) const {
+  log_duration_t time_left = time_limit * (100 - RESERVE_PERCENT) / 100 - timer.Elapsed();
+  return std::max(
+      TurnBudget(turns_left, placements),
+      time_left - PredictLaterTurns(turns_left, placements));
+}
+
+log_duration_t TimeManager::PredictLaterTurns(int turns_left, int placements) const {
+  double factor = second_ply_pairs > 0
+      ? static_cast<double>(second_ply_nodes) / second_ply_pairs
+      : DEFAULT_SECOND_PLY_NODE_FACTOR;
+
+  // The number of placements decreases about linearly to 0 over the rest of
+  // the game, so after k more turns there are about p*(1 - k/n) left, where n
+  // is the number of turns left. The cost of a depth 2 search grows with the
+  // square of that, so the total over the later turns is factor * p^2 times
+  // the sum of (1 - k/n)^2 for k = 1..n-1, which is (n-1)*(2n-1)/(6n).
+  double p = placements;
+  double n = turns_left;
+  double nodes = factor * p * p * (n - 1) * (2*n - 1) / (6*n);
+  return log_duration_t(static_cast<int64_t>(nodes / NodeRate()));
+}
+
+void TimeManager::RecordSearch(int depth, int64_t nodes, log_duration_t duration) {
+  // Depth 1 doesn't count nodes, so it would only drag the node rate down.
+  if (depth == 1) return;
+  total_nodes += nodes;
+  total_duration += duration;
+}
+
+void TimeManager::RecordSecondPly(int roots, int placements, int64_t nodes, bool completed) {
+  if (!completed) return;
+  second_ply_nodes += nodes;
+  second_ply_pairs += static_cast<int64_t>(roots) * placements;
+}
+
+void TimeManager::RecordExtraPly(int roots, int placements, int64_t nodes, bool completed) {
+  double p = placements;
+  double factor = nodes / (roots * p * p);
+  if (completed) {
+    // Pruning makes the factor vary between positions, so I take the average
+    // of the old and new value.
+    extra_ply_node_factor = (extra_ply_node_factor + factor) / 2;
+  } else {
+    extra_ply_node_factor = std::max(extra_ply_node_factor, factor);
+  }
+}
+
+log_duration_t TimeManager::PredictExtraPly(int roots, int placements) const {
+  double p = placements;
+  double nodes = extra_ply_node_factor * roots * p * p;
+  return log_duration_t(static_cast<int64_t>(nodes / NodeRate()));
+}
+
+double TimeManager::NodeRate() const {
+  if (total_duration < MIN_MEASURED_DURATION) return DEFAULT_NODE_RATE;
+  return static_cast<double>(total_nodes) / total_duration.count();
+}
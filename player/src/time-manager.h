@@ -0,0 +1,177 @@
+// Classes to keep track of time, and decide how much of it to spend on each
+// turn.
+
+#ifndef TIME_MANAGER_H_INCLUDED
+#define TIME_MANAGER_H_INCLUDED
+
+#include "logging.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+
+// A simple timer. Can be running or paused. Tracks time both while running and
+// while paused. Use Elapsed() to query, Pause() and Resume() to switch states.
+class Timer {
+public:
+  Timer(bool running = true) : running(running) {}
+
+  bool Running() const { return running; }
+  bool Paused() const { return !running; }
+
+  // Returns how much time passed in the given state, in total.
+  log_duration_t Elapsed(bool while_running = true) const {
+    clock_t::duration d = elapsed[while_running];
+    if (running == while_running) d += clock_t::now() - start;
+    return std::chrono::duration_cast<log_duration_t>(d);
+  }
+
+  log_duration_t Pause() {
+    assert(Running());
+    return TogglePause();
+  }
+
+  log_duration_t Resume() {
+    assert(Paused());
+    return TogglePause();
+  }
+
+  // Toggles running state, and returns how much time passed since last toggle.
+  log_duration_t TogglePause() {
+    auto end = clock_t::now();
+    auto delta = end - start;
+    elapsed[running] += delta;
+    start = end;
+    running = !running;
+    return std::chrono::duration_cast<log_duration_t>(delta);
+  }
+
+private:
+  using clock_t = std::chrono::steady_clock;
+
+  bool running = false;
+  clock_t::time_point start = clock_t::now();
+  clock_t::duration elapsed[2] = {clock_t::duration{0}, clock_t::duration{0}};
+};
+
+// A point in time, measured by a running Timer, after which the search must
+// stop. The expired flag is shared between search threads, so once any
+// thread notices that the deadline passed, the others stop too.
+class Deadline {
+public:
+  // Creates a deadline that never expires.
+  Deadline() {}
+
+  Deadline(const Timer *timer, log_duration_t limit) : timer(timer), limit(limit) {}
+
+  // Returns whether the deadline passed. If this returns true, the caller
+  // must abandon the search, since results are no longer exact.
+  bool Expired() const {
+    if (expired.load(std::memory_order_relaxed)) return true;
+    if (timer == nullptr || timer->Elapsed() < limit) return false;
+    expired.store(true, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Makes the deadline expire immediately. May be called from any thread.
+  void Cancel() { expired.store(true, std::memory_order_relaxed); }
+
+  log_duration_t TimeLeft() const {
+    if (timer == nullptr) return log_duration_t::max();
+    return limit - timer->Elapsed();
+  }
+
+private:
+  const Timer *timer = nullptr;
+  log_duration_t limit = log_duration_t::max();
+  mutable std::atomic<bool> expired = false;
+};
+
+// Decides how much time to spend on each turn.
+//
+// The time limit covers the whole game, and the speed of the machine is not
+// known in advance (the official server is about twice as slow as my laptop),
+// so the time manager measures how many search nodes per millisecond it
+// evaluates, and uses that to predict how long deeper searches will take.
+// The caller decides what counts as a search node, as long as the time per
+// node is roughly constant.
+class TimeManager {
+public:
+  TimeManager(const Timer &timer, log_duration_t time_limit)
+    : timer(timer), time_limit(time_limit) {}
+
+  // Predicts the number of turns I have left, including the current one,
+  // from the number of empty cells and the number of valid placements.
+  static int PredictTurnsLeft(int empty_cells, int placements);
+
+  // Returns how much time the current turn may take, given the number of
+  // turns left (including the current one) and the number of valid
+  // placements.
+  log_duration_t TurnBudget(int turns_left, int placements) const;
+
+  // Returns how much time the current turn may take to complete the search
+  // without the extra ply: all the time that later turns are not predicted to
+  // need, but at least TurnBudget(). The turn budget decides how deep to
+  // search, but depth 2 isn't given up as long as the game has time for it.
+  log_duration_t ShallowBudget(int turns_left, int placements) const;
+
+  // Returns a deadline that expires when the given budget, starting now, is
+  // used up.
+  Deadline MakeDeadline(log_duration_t budget) const {
+    return Deadline(&timer, timer.Elapsed() + budget);
+  }
+
+  // Records that a search iteration at the given depth evaluated `nodes`
+  // search nodes in the given time. Iterations at depth 1 don't count toward
+  // the node rate, since they evaluate placements without counting nodes.
+  void RecordSearch(int depth, int64_t nodes, log_duration_t duration);
+
+  // Records that a depth 2 search of `roots` root placements, out of
+  // `placements` valid placements, evaluated `nodes` search nodes. Abandoned
+  // searches are ignored, since they were cut off by the deadline, and say
+  // little about how long the search would have taken.
+  void RecordSecondPly(int roots, int placements, int64_t nodes, bool completed);
+
+  // Records that an extra-ply search of `roots` root placements, out of
+  // `placements` valid placements, evaluated `nodes` search nodes. If the
+  // search was abandoned, the node count is only a lower bound.
+  void RecordExtraPly(int roots, int placements, int64_t nodes, bool completed);
+
+  // Predicts the time needed for an extra-ply search of `roots` root
+  // placements, out of `placements` valid placements. (There are fewer roots
+  // than placements if the beam excludes some of them.)
+  log_duration_t PredictExtraPly(int roots, int placements) const;
+
+private:
+  // Measured nodes per millisecond, or a pessimistic default if nothing has
+  // been measured yet.
+  double NodeRate() const;
+
+  // Predicts the time needed for depth 2 searches in the turns after the
+  // current one, given the number of turns left (including the current one)
+  // and the number of valid placements now.
+  log_duration_t PredictLaterTurns(int turns_left, int placements) const;
+
+  const Timer &timer;
+  const log_duration_t time_limit;
+
+  int64_t total_nodes = 0;
+  log_duration_t total_duration = log_duration_t(0);
+
+  // Total number of nodes in completed depth 2 searches, and the sum of
+  // roots times placements over those searches. Their ratio is the number of
+  // nodes per (root, reply) pair, which varies between 3 and 65 in practice,
+  // depending on how much is pruned.
+  int64_t second_ply_nodes = 0;
+  int64_t second_ply_pairs = 0;
+
+  // Number of nodes in an extra-ply search with p valid placements, divided
+  // by p^3 (or rather, by the number of roots times p^2, since each root is
+  // searched independently). Without pruning, it would grow with p^4. Varies
+  // between 40 and 180 in practice. Starts out on the high side, then is
+  // updated with measured values.
+  double extra_ply_node_factor = 100;
+};
+
+#endif  // ndef TIME_MANAGER_H_INCLUDED